@@ -10,20 +10,26 @@ private:
    int size;
    string type;
    vector<Neuron*> neurons;
-   void performGhostNeuronMsgPassing();
+   void activate(vector<double> &outputs);
 public:
    Neuron *ghostNeuronTop;
    Neuron *ghostNeuronBottom;
 
    Layer(const int &_size, const int &numNeuronsInNextLayer, const string &_type, const int &_index);
+   ~Layer();
    void setOutputValueForNeuronAtIndex(int index, double _outputValue);
    string getType();
    int getSize();
    int getIndex();
    vector<Neuron*> getNeurons();
    void feedForward(Layer *prevLayer);
+   void feedForwardInto(Layer *prevLayer, const vector<double> &prevOutputs, vector<double> &outputs);
+   void feedForwardFrom(const double *weights, const vector<double> &prevOutputs, double ghostTop, double ghostBottom, vector<double> &outputs);
+   void performGhostNeuronMsgPassing();
+   void exchangeGhostOutputs(vector<double> &firstOutputs, vector<double> &lastOutputs, vector<double> &ghostTops, vector<double> &ghostBottoms, MPI_Comm comm);
    void calcHiddenGradients(Layer *nextLayer);
-   void updateWeights(Layer *prevLayer, int layerNum);
+   void calcHiddenGradientsInto(const vector<double> &outputs, const vector<double> &nextGradients, vector<double> &gradients);
+   void updateWeights(Layer *prevLayer, int layerNum, Optimizer *optimizer);
    void setNeuronGradientForNeuronAtIndex(int index, double gradient);
 };
 
@@ -68,6 +74,14 @@ Layer::Layer(const int &_size, const int &numNeuronsInNextLayer, const string &_
    }
 }
 
+Layer::~Layer() {
+   for (int i = 0; i < neurons.size(); i++) {
+      delete neurons[i];
+   }
+   delete ghostNeuronTop;
+   delete ghostNeuronBottom;
+}
+
 string Layer::getType() {
    return type;
 }
@@ -90,112 +104,21 @@ void Layer::setOutputValueForNeuronAtIndex(int index, double _outputValue) {
 }
 
 // Parallel Forward Propgation function. Performs all the message passing required for the
-// current layer.
+// current layer. Neighbouring ranks on the same node exchange through shared memory.
 void Layer::performGhostNeuronMsgPassing() {
 
-   double startTimeRcv1 = 0;
-   double endTimeRcv1 = 0;
-   double totalTimeRcv1 = 0;
-
-   double startTimeRcv2 = 0;
-   double endTimeRcv2 = 0;
-   double totalTimeRcv2 = 0;
-
-   double ghostTopOutput;
-   double ghostBottomOutput;
+   double startTimeRcv = 0;
+   double ghostTopOutput = 0;
+   double ghostBottomOutput = 0;
    double firstNeuronOutput = neurons[0]->getOutput();
    double lastNeuronOutput = neurons[neurons.size() - 1]->getOutput();
 
-   MPI_Status status;
-   MPI_Request rcvTopRequest;
-   MPI_Request rcvBottomRequest;
-   MPI_Request sndBottomRequest;
-   MPI_Request sndTopRequest;
-
-
    if (type != "output" and worldSize > 2) {
-      if (myRank == 1) { // FIRST RANK
-
-         // R_0 (firstNeuronOutput) -> R_N (ghostBottom)
-         MPI_Isend(&firstNeuronOutput, 1, MPI_DOUBLE, (worldSize - 1), 0, MPI_COMM_WORLD, &sndBottomRequest);
-         MPI_Wait(&sndBottomRequest, &status);
-
-         // R_0 (lastNeuronOuput) -> R_2 (ghostTop)
-         MPI_Isend(&lastNeuronOutput, 1, MPI_DOUBLE, 2, 0, MPI_COMM_WORLD, &sndTopRequest);
-         MPI_Wait(&sndTopRequest, &status);
-
-         // ghostBottomOutput <- R_2 (firstNeuronOutput)
-         int ret = MPI_Irecv(&ghostBottomOutput, 1, MPI_DOUBLE, 2, 0, MPI_COMM_WORLD, &rcvBottomRequest);
-         MPI_Wait(&rcvBottomRequest, &status);
-         if (ret == MPI_SUCCESS) {
-            ghostNeuronBottom->setOutput(ghostBottomOutput);
-         }
-
-         // ghostTopOutput <- R_N (lastNeuronOutput)
-         int ret2 = MPI_Irecv(&ghostTopOutput, 1, MPI_DOUBLE, (worldSize - 1), 0, MPI_COMM_WORLD, &rcvTopRequest);
-         MPI_Wait(&rcvTopRequest, &status);
-         if (ret2 == MPI_SUCCESS) {
-            ghostNeuronTop->setOutput(ghostTopOutput);
-         }
-
-      } else if (myRank == worldSize - 1) { // LAST RANK
-
-         // R_Last (firstNeuronOutput) -> R_Last-1 (ghostBottom)
-         MPI_Isend(&firstNeuronOutput, 1, MPI_DOUBLE, (myRank - 1), 0, MPI_COMM_WORLD, &sndBottomRequest);
-         MPI_Wait(&sndBottomRequest, &status);
-
-         // R_Last (lastNeuronOutput) -> R_1 (ghostTop)
-         MPI_Isend(&lastNeuronOutput, 1, MPI_DOUBLE, 1, 0, MPI_COMM_WORLD, &sndTopRequest);
-         MPI_Wait(&sndTopRequest, &status);
-
-         // ghostBottomOutput <- R_1 (firstNeuronOutput)
-         int ret = MPI_Irecv(&ghostBottomOutput, 1, MPI_DOUBLE, 1, 0, MPI_COMM_WORLD, &rcvBottomRequest);
-         MPI_Wait(&rcvBottomRequest, &status);
-         if (ret == MPI_SUCCESS) {
-            ghostNeuronBottom->setOutput(ghostBottomOutput);
-
-         }
-
-         // ghostTopOutput <- R_0 (firstNeuronOutput)
-         int ret2 = MPI_Irecv(&ghostTopOutput, 1, MPI_DOUBLE, (myRank - 1), 0, MPI_COMM_WORLD, &rcvTopRequest);
-         MPI_Wait(&rcvTopRequest, &status);
-         if (ret2 == MPI_SUCCESS) {
-            ghostNeuronTop->setOutput(ghostTopOutput);
-         }
-
-      } else { // ALL RANKS INBETWEEN
-
-         // R_r (firstNeuronOutput) -> R_r-1 (ghostBottom)
-         MPI_Isend(&firstNeuronOutput, 1, MPI_DOUBLE, (myRank - 1), 0, MPI_COMM_WORLD, &sndBottomRequest);
-         MPI_Wait(&sndBottomRequest, &status);
-
-         // R_r (lastNeuronOutput) -> R_r+1 (ghostTop)
-         MPI_Isend(&lastNeuronOutput, 1, MPI_DOUBLE, (myRank + 1), 0, MPI_COMM_WORLD, &sndTopRequest);
-         MPI_Wait(&sndTopRequest, &status);
-
-         // ghostBottomOutput <- R_r+1 (lastNeuronOutput)
-         startTimeRcv1 = MPI_Wtime();
-         int ret = MPI_Irecv(&ghostBottomOutput, 1, MPI_DOUBLE, (myRank + 1), 0, MPI_COMM_WORLD, &rcvBottomRequest);
-         MPI_Wait(&rcvBottomRequest, &status);
-         if (ret == MPI_SUCCESS) {
-            ghostNeuronBottom->setOutput(ghostBottomOutput);
-            endTimeRcv1 = MPI_Wtime();
-            totalTimeRcv1 = endTimeRcv1 - startTimeRcv1;
-            rankTime += totalTimeRcv1;
-         }
-
-         // ghostTopOutput <- R_r-1 (lastNeuronOutput)
-         startTimeRcv2 = MPI_Wtime();
-         int ret2 = MPI_Irecv(&ghostTopOutput, 1, MPI_DOUBLE, (myRank - 1), 0, MPI_COMM_WORLD, &rcvTopRequest);
-         MPI_Wait(&rcvTopRequest, &status);
-         if (ret2 == MPI_SUCCESS) {
-            ghostNeuronTop->setOutput(ghostTopOutput);
-            endTimeRcv2 = MPI_Wtime();
-            totalTimeRcv2 = endTimeRcv2 - startTimeRcv2;
-            rankTime += totalTimeRcv2;
-
-         }
-      }
+      startTimeRcv = MPI_Wtime();
+      topology->ringExchange(&firstNeuronOutput, &lastNeuronOutput, 1, &ghostTopOutput, &ghostBottomOutput, MPI_COMM_WORLD);
+      ghostNeuronTop->setOutput(ghostTopOutput);
+      ghostNeuronBottom->setOutput(ghostBottomOutput);
+      rankTime += MPI_Wtime() - startTimeRcv;
    }
 }
 
@@ -210,6 +133,99 @@ void Layer::feedForward(Layer *prevLayer) {
 
 }
 
+/*
+   Batched version of performGhostNeuronMsgPassing. Exchanges the first and last
+   neuron outputs of every sample in a batch with the neighbouring ranks using
+   one exchange per direction instead of one per sample.
+
+   Input: firstOutputs, lastOutputs
+      Output of this rank's first and last neuron for each sample
+   Output: ghostTops, ghostBottoms
+      Ghost neuron outputs for each sample
+   Input: comm
+      Communicator used for messages to neighbours on other nodes
+*/
+void Layer::exchangeGhostOutputs(vector<double> &firstOutputs, vector<double> &lastOutputs, vector<double> &ghostTops, vector<double> &ghostBottoms, MPI_Comm comm) {
+   int count = firstOutputs.size();
+   ghostTops.assign(count, 0.0);
+   ghostBottoms.assign(count, 0.0);
+
+   if (type != "output" and worldSize > 2 and count > 0) {
+      topology->ringExchange(&firstOutputs[0], &lastOutputs[0], count, &ghostTops[0], &ghostBottoms[0], comm);
+   }
+}
+
+/*
+   Same computation as feedForward but reads the previous layer's outputs from
+   prevOutputs and writes this layer's outputs into outputs instead of the
+   neurons, so several threads can propagate different samples at once. The
+   weights and ghost neuron outputs are only read. No message passing is done.
+*/
+void Layer::feedForwardInto(Layer *prevLayer, const vector<double> &prevOutputs, vector<double> &outputs) {
+   vector<Neuron*> prevLayerNeurons = prevLayer->getNeurons();
+   outputs.assign(size, 0.0);
+   double *sums = &outputs[0];
+
+   for (int i = 0; i < prevLayerNeurons.size(); i++) {
+      double input = prevOutputs[i];
+      Connection *weights = prevLayerNeurons[i]->getOutputWeightData();
+      for (int j = 0; j < size; j++) {
+         sums[j] += input * weights[j].weight;
+      }
+   }
+
+   if (index > 1) {
+      double ghostTop = prevLayer->ghostNeuronTop->getOutput();
+      double ghostBottom = prevLayer->ghostNeuronBottom->getOutput();
+      Connection *topWeights = prevLayer->ghostNeuronTop->getOutputWeightData();
+      Connection *bottomWeights = prevLayer->ghostNeuronBottom->getOutputWeightData();
+      for (int j = 0; j < size; j++) {
+         sums[j] += ghostTop * topWeights[j].weight + ghostBottom * bottomWeights[j].weight;
+      }
+   }
+
+   activate(outputs);
+}
+
+/*
+   As above but with the weights read from a copy instead of the previous layer's
+   neurons, see Network::snapshotWeights. weights holds one row of size values per
+   neuron of the previous layer followed by the rows of its top and bottom ghost
+   neurons. The ghost neuron outputs are given explicitly.
+*/
+void Layer::feedForwardFrom(const double *weights, const vector<double> &prevOutputs, double ghostTop, double ghostBottom, vector<double> &outputs) {
+   int numPrev = prevOutputs.size();
+   outputs.assign(size, 0.0);
+   double *sums = &outputs[0];
+
+   for (int i = 0; i < numPrev; i++) {
+      double input = prevOutputs[i];
+      const double *row = weights + (long)i * size;
+      for (int j = 0; j < size; j++) {
+         sums[j] += input * row[j];
+      }
+   }
+
+   if (index > 1) {
+      const double *topRow = weights + (long)numPrev * size;
+      const double *bottomRow = topRow + size;
+      for (int j = 0; j < size; j++) {
+         sums[j] += ghostTop * topRow[j] + ghostBottom * bottomRow[j];
+      }
+   }
+
+   activate(outputs);
+}
+
+// Use the sigmoid activation function on the first hidden layer, the layers above are linear
+void Layer::activate(vector<double> &outputs) {
+   if (index < 2) {
+      for (int j = 0; j < size; j++) {
+         outputs[j] = Neuron::sigmoid(outputs[j]);
+      }
+   }
+}
+
 // Calculate the gradients of the hidden layer
 void Layer::calcHiddenGradients(Layer *nextLayer) {
    vector<Neuron*> nextLayerNeurons = nextLayer->getNeurons();
@@ -218,15 +234,37 @@ void Layer::calcHiddenGradients(Layer *nextLayer) {
    }
 }
 
+// Same computation as calcHiddenGradients but on caller owned buffers. See feedForwardInto.
+void Layer::calcHiddenGradientsInto(const vector<double> &outputs, const vector<double> &nextGradients, vector<double> &gradients) {
+   int numNext = nextGradients.size();
+   gradients.resize(size);
+
+   // The ghost neuron contribution is the same for every neuron in the layer
+   const double *next = &nextGradients[0];
+   double ghostSum = ghostNeuronTop->dotOutputWeights(next, numNext) + ghostNeuronBottom->dotOutputWeights(next, numNext);
+
+   for (int i = 0; i < size; i++) {
+      double sum = neurons[i]->dotOutputWeights(next, numNext);
+      gradients[i] = (sum + ghostSum) * Neuron::sigmoidDerivative(outputs[i]);
+   }
+}
+
 // Utility function. Pretty obvious from the name what it does
 void Layer::setNeuronGradientForNeuronAtIndex(int index, double gradient) {
    neurons[index]->setGradient(gradient);
 }
 
-// Part of gradient descent. Updates all the weights in the layer.
-void Layer::updateWeights(Layer *prevLayer, int layerNum) {
+// Part of gradient descent. Updates all the weights in the layer using the
+// given optimizer in a single pass over the previous layer's connections.
+void Layer::updateWeights(Layer *prevLayer, int layerNum, Optimizer *optimizer) {
    vector<Neuron*> prevLayerNeurons = prevLayer->getNeurons();
+   vector<double> inputs(prevLayerNeurons.size());
+   vector<double> gradients(neurons.size());
+   for (int i = 0; i < prevLayerNeurons.size(); i++) {
+      inputs[i] = prevLayerNeurons[i]->getOutput();
+   }
    for (int i = 0; i < neurons.size(); i++) {
-      neurons[i]->updateWeights(prevLayerNeurons, ghostNeuronTop, ghostNeuronBottom, layerNum);
+      gradients[i] = neurons[i]->getGradient();
    }
+   optimizer->updateLayer(layerNum, prevLayerNeurons, inputs, gradients);
 }
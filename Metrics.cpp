@@ -0,0 +1,357 @@
+/*
+   Class to stream structured run metrics
+
+   Every iteration each rank records its phase timings, communication counters
+   and memory. The records are gathered on rank 0 with a non-blocking gather that
+   is completed one iteration later, so training never waits on the metrics. Rank 0
+   writes one JSON object per iteration to a file or to a Unix domain socket.
+
+   The socket is non-blocking. Lines a slow monitor has not taken yet are kept in
+   a buffer of at most METRICS_SOCKET_BUFFER bytes, when it is full new lines are
+   dropped and counted instead of stalling rank 0.
+*/
+
+using namespace std;
+
+// Phases timed inside an iteration
+const int PHASE_FORWARD = 0;
+const int PHASE_LOSS = 1;
+const int PHASE_BACKWARD = 2;
+const int PHASE_HOGWILD = 3;
+const int PHASE_EVAL = 4;
+const int NUM_PHASES = 5;
+
+// Layout of the per rank record gathered every iteration
+const int METRIC_TIME = NUM_PHASES;
+const int METRIC_LOSS = NUM_PHASES + 1;
+const int METRIC_COMM_BYTES = NUM_PHASES + 2;
+const int METRIC_COMM_WAIT = NUM_PHASES + 3;
+const int METRIC_RSS = NUM_PHASES + 4;
+const int METRIC_COMM_MESSAGES = NUM_PHASES + 5;
+const int METRIC_PEAK_RSS = NUM_PHASES + 6;
+const int NUM_METRICS = NUM_PHASES + 7;
+
+const size_t METRICS_SOCKET_BUFFER = 1 << 20;
+
+const char *phaseNames[NUM_PHASES] = {"forward", "loss", "backward", "hogwild", "eval"};
+
+class MetricsLogger {
+private:
+   bool enabled;
+   FILE *outFile;
+   int socketFd;
+   string socketOutput;
+   long droppedLines;
+   MPI_Comm comm;
+   MPI_Request request;
+   int buffer;
+   double localRecord[2][NUM_METRICS];
+   vector<double> gatheredRecords[2];
+   int pendingIteration;
+   int pendingSamples;
+   string pendingMode;
+   double iterationStart;
+   double phaseStart[NUM_PHASES];
+   long long startCommBytes;
+   long long startCommMessages;
+   double startCommWait;
+   void completePending();
+   string jsonNumber(const char *format, double value);
+   void writeLine(const string &line);
+   void flushSocket(int timeoutMs);
+   double currentRss();
+public:
+   MetricsLogger(const string &destination);
+   ~MetricsLogger();
+   bool isEnabled();
+   void beginIteration();
+   void startPhase(int phase);
+   void endPhase(int phase);
+   void endIteration(int iteration, const string &mode, int samples, double loss);
+   void finish();
+};
+
+/*
+   Construct a metrics logger. Collective over MPI_COMM_WORLD.
+
+   Input: destination
+      Where rank 0 writes the JSON lines. "unix:<path>" connects to a listening
+      Unix domain socket, anything else is used as a file name. An empty string
+      disables the metrics.
+
+   Return: MetricsLogger object
+*/
+MetricsLogger::MetricsLogger(const string &destination) {
+   enabled = !destination.empty();
+   outFile = NULL;
+   socketFd = -1;
+   droppedLines = 0;
+   comm = MPI_COMM_NULL;
+   request = MPI_REQUEST_NULL;
+   buffer = 0;
+   pendingIteration = -1;
+   pendingSamples = 0;
+   iterationStart = 0;
+   startCommBytes = 0;
+   startCommMessages = 0;
+   startCommWait = 0;
+
+   if (!enabled) {
+      return;
+   }
+
+   MPI_Comm_dup(MPI_COMM_WORLD, &comm);
+   for (int i = 0; i < 2; i++) {
+      gatheredRecords[i].resize(NUM_METRICS * worldSize);
+   }
+
+   if (myRank == 0) {
+      if (destination.compare(0, 5, "unix:") == 0) {
+         string path = destination.substr(5);
+         struct sockaddr_un address;
+         memset(&address, 0, sizeof(address));
+         address.sun_family = AF_UNIX;
+         strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+         socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+         if (socketFd < 0 || connect(socketFd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            cout << "Warning: could not connect to metrics socket " << path << ", metrics are not written." << "\n";
+            if (socketFd >= 0) {
+               close(socketFd);
+            }
+            socketFd = -1;
+         } else {
+            fcntl(socketFd, F_SETFL, fcntl(socketFd, F_GETFL, 0) | O_NONBLOCK);
+         }
+      } else {
+         outFile = fopen(destination.c_str(), "w");
+         if (outFile == NULL) {
+            cout << "Warning: could not open metrics file " << destination << ", metrics are not written." << "\n";
+         }
+      }
+   }
+}
+
+MetricsLogger::~MetricsLogger() {
+   finish();
+   if (outFile != NULL) {
+      fclose(outFile);
+   }
+   if (socketFd >= 0) {
+      // Give the monitor a moment to take what is still buffered
+      flushSocket(1000);
+      if (!socketOutput.empty()) {
+         droppedLines += count(socketOutput.begin(), socketOutput.end(), '\n');
+      }
+      close(socketFd);
+   }
+   if (droppedLines > 0) {
+      cout << "Warning: the metrics socket could not keep up, " << droppedLines << " lines were dropped." << "\n";
+   }
+   if (comm != MPI_COMM_NULL) {
+      MPI_Comm_free(&comm);
+   }
+}
+
+bool MetricsLogger::isEnabled() {
+   return enabled;
+}
+
+void MetricsLogger::writeLine(const string &line) {
+   if (outFile != NULL) {
+      fputs(line.c_str(), outFile);
+      fflush(outFile);
+   } else if (socketFd >= 0) {
+      flushSocket(0);
+      if (socketOutput.size() + line.size() > METRICS_SOCKET_BUFFER) {
+         droppedLines++;
+         return;
+      }
+      socketOutput += line;
+      flushSocket(0);
+   }
+}
+
+/*
+   Send as much of the buffered socket output as the monitor takes without
+   blocking. Partial sends leave the rest of the line in the buffer.
+
+   Input: timeoutMs
+      How long to wait for the socket to become writable when it is full, 0
+      never waits
+*/
+void MetricsLogger::flushSocket(int timeoutMs) {
+   double deadline = MPI_Wtime() + timeoutMs / 1000.0;
+   size_t sent = 0;
+   while (socketFd >= 0 && sent < socketOutput.size()) {
+      ssize_t n = send(socketFd, socketOutput.data() + sent, socketOutput.size() - sent, MSG_NOSIGNAL);
+      if (n > 0) {
+         sent += n;
+         continue;
+      }
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+         // A monitor that went away must not kill the run
+         droppedLines += count(socketOutput.begin() + sent, socketOutput.end(), '\n');
+         socketOutput.clear();
+         sent = 0;
+         close(socketFd);
+         socketFd = -1;
+         break;
+      }
+      int remaining = (int)((deadline - MPI_Wtime()) * 1000);
+      if (remaining <= 0) {
+         break;
+      }
+      struct pollfd writable = {socketFd, POLLOUT, 0};
+      poll(&writable, 1, remaining);
+   }
+   socketOutput.erase(0, sent);
+}
+
+// Resident set size in MB right now, NaN where /proc is not available
+double MetricsLogger::currentRss() {
+   long pages = 0;
+   long resident = 0;
+   FILE *statm = fopen("/proc/self/statm", "r");
+   if (statm == NULL) {
+      return NAN;
+   }
+   int fields = fscanf(statm, "%ld %ld", &pages, &resident);
+   fclose(statm);
+   if (fields != 2) {
+      return NAN;
+   }
+   return resident * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+// Format a number for the JSON stream. JSON has no NaN or infinity, those are written as null.
+string MetricsLogger::jsonNumber(const char *format, double value) {
+   if (!isfinite(value)) {
+      return "null";
+   }
+   char number[64];
+   snprintf(number, sizeof(number), format, value);
+   return number;
+}
+
+// Wait for the gather of the previous iteration and write it out on rank 0
+void MetricsLogger::completePending() {
+   if (request == MPI_REQUEST_NULL) {
+      return;
+   }
+   MPI_Wait(&request, MPI_STATUS_IGNORE);
+
+   if (myRank == 0) {
+      vector<double> &records = gatheredRecords[1 - buffer];
+      double maxPhase[NUM_PHASES] = {0};
+      double maxTime = 0;
+      double maxTrainTime = 0;
+      double maxWait = 0;
+      double totalBytes = 0;
+      double totalMessages = 0;
+      for (int r = 0; r < worldSize; r++) {
+         double *record = &records[r * NUM_METRICS];
+         for (int p = 0; p < NUM_PHASES; p++) {
+            maxPhase[p] = max(maxPhase[p], record[p]);
+         }
+         maxTime = max(maxTime, record[METRIC_TIME]);
+         maxTrainTime = max(maxTrainTime, record[METRIC_TIME] - record[PHASE_EVAL]);
+         maxWait = max(maxWait, record[METRIC_COMM_WAIT]);
+         totalBytes += record[METRIC_COMM_BYTES];
+         totalMessages += record[METRIC_COMM_MESSAGES];
+      }
+
+      // Rank 0 holds no part of the network, the loss is taken from rank 1.
+      // Evaluation is left out of the throughput, as in train().
+      char field[256];
+      string line = "{";
+      snprintf(field, sizeof(field), "\"iter\":%d,\"mode\":\"%s\",\"samples\":%d,\"time\":%.6f,\"samples_per_sec\":%.3f,",
+               pendingIteration, pendingMode.c_str(), pendingSamples, maxTime,
+               maxTrainTime > 0 ? pendingSamples / maxTrainTime : 0.0);
+      line += field;
+      line += "\"loss\":" + jsonNumber("%.9g", records[NUM_METRICS + METRIC_LOSS]) + ",";
+      line += "\"phases\":{";
+      for (int p = 0; p < NUM_PHASES; p++) {
+         snprintf(field, sizeof(field), "%s\"%s\":%.6f", p > 0 ? "," : "", phaseNames[p], maxPhase[p]);
+         line += field;
+      }
+      snprintf(field, sizeof(field), "},\"comm_bytes\":%.0f,\"comm_messages\":%.0f,\"comm_wait_max\":%.6f,\"ranks\":[", totalBytes, totalMessages, maxWait);
+      line += field;
+      for (int r = 0; r < worldSize; r++) {
+         double *record = &records[r * NUM_METRICS];
+         snprintf(field, sizeof(field), "%s{\"rank\":%d,\"time\":%.6f,\"comm_bytes\":%.0f,\"comm_messages\":%.0f,\"comm_wait\":%.6f,",
+                  r > 0 ? "," : "", r, record[METRIC_TIME], record[METRIC_COMM_BYTES], record[METRIC_COMM_MESSAGES], record[METRIC_COMM_WAIT]);
+         line += field;
+         line += "\"rss_mb\":" + jsonNumber("%.2f", record[METRIC_RSS]) + ",";
+         line += "\"peak_rss_mb\":" + jsonNumber("%.2f", record[METRIC_PEAK_RSS]) + "}";
+      }
+      line += "]}\n";
+      writeLine(line);
+   }
+}
+
+void MetricsLogger::beginIteration() {
+   if (!enabled) {
+      return;
+   }
+   double *record = localRecord[buffer];
+   for (int i = 0; i < NUM_METRICS; i++) {
+      record[i] = 0.0;
+   }
+   iterationStart = MPI_Wtime();
+   startCommBytes = commBytes;
+   startCommMessages = commMessages;
+   startCommWait = commWaitTime;
+}
+
+void MetricsLogger::startPhase(int phase) {
+   if (enabled) {
+      phaseStart[phase] = MPI_Wtime();
+   }
+}
+
+void MetricsLogger::endPhase(int phase) {
+   if (enabled) {
+      localRecord[buffer][phase] += MPI_Wtime() - phaseStart[phase];
+   }
+}
+
+/*
+   Record the end of an iteration and post the gather of this iteration's
+   records. The gather of the previous iteration is completed first, it has had
+   a whole iteration to finish.
+*/
+void MetricsLogger::endIteration(int iteration, const string &mode, int samples, double loss) {
+   if (!enabled) {
+      return;
+   }
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+
+   double *record = localRecord[buffer];
+   record[METRIC_TIME] = MPI_Wtime() - iterationStart;
+   record[METRIC_LOSS] = loss;
+   record[METRIC_COMM_BYTES] = (double)(commBytes - startCommBytes);
+   record[METRIC_COMM_WAIT] = commWaitTime - startCommWait;
+   record[METRIC_COMM_MESSAGES] = (double)(commMessages - startCommMessages);
+   // ru_maxrss is a high water mark the kernel updates lazily, it can trail the current size
+   record[METRIC_RSS] = currentRss();
+   record[METRIC_PEAK_RSS] = usage.ru_maxrss / 1024.0;
+   if (record[METRIC_RSS] > record[METRIC_PEAK_RSS]) {
+      record[METRIC_PEAK_RSS] = record[METRIC_RSS];
+   }
+
+   completePending();
+   MPI_Igather(record, NUM_METRICS, MPI_DOUBLE, &gatheredRecords[buffer][0], NUM_METRICS, MPI_DOUBLE, 0, comm, &request);
+   pendingIteration = iteration;
+   pendingSamples = samples;
+   pendingMode = mode;
+   buffer = 1 - buffer;
+}
+
+// Flush the last outstanding iteration. Collective.
+void MetricsLogger::finish() {
+   if (enabled) {
+      completePending();
+   }
+}
@@ -7,6 +7,43 @@ using namespace std;
 struct LayerTopology {
    int size;
    string type;
+   bool checkpoint;  // keep this layer's activations for back propagation
+};
+
+// Metrics produced by an evaluation pass. Identical on every rank.
+struct EvaluationMetrics {
+   int numSamples;
+   double top1Accuracy;
+   double topKAccuracy;
+   double crossEntropy;
+   int numNonFinite;     // samples with a NaN or infinite output, not scored
+};
+
+/*
+   An evaluation pass that is advanced one batch at a time between training
+   iterations, see beginEvaluation. The batches are scored against a copy of the
+   weights taken when the pass began, so training can go on in between.
+*/
+struct EvaluationPass {
+   bool active;
+   int batchSize;
+   int topK;
+   int nextSample;
+   int pendingCount;              // samples in the gather still in flight
+   int buffer;
+   MPI_Request request;
+   EvaluationMetrics metrics;
+   vector<vector<double> > weights;                 // weights feeding every layer, see snapshotWeights
+   vector<vector<vector<double> > > batchOutputs;
+   vector<double> localRecords[2];
+   vector<double> allRecords[2];
+};
+
+// Per thread activations and gradients used by hogwild training
+struct HogwildWorkspace {
+   vector<vector<double> > outputs;
+   vector<vector<double> > gradients;
+   long heldBytes;                // bytes last reported to trackActivationMemory
 };
 
 class Network {
@@ -18,16 +55,51 @@ private:
    vector<vector<double> > outputData;
    vector<double> targetOutput;
    vector<double> outputGradients;
+   Optimizer *optimizer;
+   bool ownsOptimizer;
+   double remoteExpSum;
+   double softmaxShift;
+   vector<HogwildWorkspace> workspaces;
+   long activationBytes;          // held by all workspaces together
+   long peakActivationBytes;
+   vector<vector<double> > validationInput;
+   vector<int> validationLabels;
+   MPI_Comm evalComm;
+   EvaluationPass evalPass;
+   void readInputData(const string &inputDataLoc, vector<vector<double> > &data);
+   void snapshotWeights(vector<vector<double> > &weights);
+   void forwardBatch(int batchStart, int count, int numThreads, vector<vector<vector<double> > > &batchOutputs);
+   void accumulateMetrics(vector<double> &records, int count, int topK, EvaluationMetrics &metrics);
    vector<double> multiclassSigmoid(vector<double> &yHat);
+   void propagateSample(int index);
+   double forwardSample(int sample, HogwildWorkspace &workspace, bool checkpointing);
+   double hogwildStep(int sample, HogwildWorkspace &workspace);
+   double sampleGradients(int sample, HogwildWorkspace &workspace);
+   void applyRoundUpdates(int count);
+   void recomputeActivations(int layerNum, HogwildWorkspace &workspace);
+   void releaseActivations(vector<double> &buffer);
+   void trackActivationMemory(HogwildWorkspace &workspace);
+   void synchronizeHogwild(int sample);
+   void initializeWeights(unsigned long long seed);
 public:
    Network();
-   void addLayer(const string &_type, const int &_size);
+   ~Network();
+   void addLayer(const string &_type, const int &_size, const bool &_checkpoint = true);
+   void setOptimizer(Optimizer *_optimizer);
    void initializeNetwork(int size);
    void loadTestingInputData(const string &inputDataLoc);
    void loadTestingOutputData(const string &outputDataLoc, const int &numClasses);
+   void loadValidationData(const string &inputDataLoc, const string &outputDataLoc, const int &numClasses);
    void forwardPropagation();
    void backwardPropagation();
    double computeLoss(int size);
+   double trainHogwild(int numSamples, int numThreads, int syncFrequency, bool rounds);
+   void beginEvaluation(int batchSize, int topK);
+   bool advanceEvaluation(int numThreads);
+   bool isEvaluating();
+   EvaluationMetrics getEvaluationMetrics();
+   void printMemoryUsage();
+   vector<double> getWeights();
 
    // For debugging purposes
    void printNetworkInfo();
@@ -36,29 +108,319 @@ public:
 };
 
 // Private Methods
+
+// The largest output is subtracted before exp() so large outputs do not overflow
 vector<double> Network::multiclassSigmoid(vector<double> &yHat) {
-   double totalExp = 0;
-   for (int i = 0; i < yHat.size(); i++) {
-      totalExp += exp(yHat[i]);
-   }
+   double maxOutput = *max_element(yHat.begin(), yHat.end());
+   double totalExp = reduceExpSum(&yHat[0], yHat.size(), maxOutput);
    for (int j = 0; j < yHat.size(); j++) {
-      yHat[j] = exp(yHat[j]) / totalExp;
+      yHat[j] = exp(yHat[j] - maxOutput) / totalExp;
    }
    return yHat;
 }
 
+// Forward propagate a single input sample through this rank's slice of the network
+void Network::propagateSample(int index) {
+   vector<double> inputSample = inputData[index];
+
+   if (myRank > 0) {
+
+      // Feed the sample input values into the neurons in the input layer
+      int inputLayerIndex = 0;
+      for (int value = 0; value < inputSample.size(); value++) {
+         layers[inputLayerIndex]->setOutputValueForNeuronAtIndex(value, inputSample[value]);
+      }
+
+      // Forward Propogate
+      for (int layerNum = 1; layerNum < layers.size(); layerNum++) {
+         // cout << layers[layerNum].getType() << " Rank " << myRank << endl;
+         Layer *prevLayer = layers[layerNum - 1];
+         layers[layerNum]->feedForward(prevLayer);
+         // MPI_Barrier(MPI_COMM_WORLD);
+      }
+
+      // Stage this rank's outputs for the gather in computeLoss
+      vector<Neuron*> outputNeurons = layers.back()->getNeurons();
+      for (int i = 0; i < outputNeurons.size(); i++) {
+         localData[i] = outputNeurons[i]->getOutput();
+      }
+
+   }
+}
+
+// Free a buffer holding activations that are no longer needed
+void Network::releaseActivations(vector<double> &buffer) {
+   vector<double>().swap(buffer);
+}
+
+/*
+   Record the bytes currently held by a workspace's activations and gradients.
+   The bytes of all workspaces are added up, so the peak is the most memory the
+   threads held at the same time. Called after every allocation.
+*/
+void Network::trackActivationMemory(HogwildWorkspace &workspace) {
+   long bytes = 0;
+   for (int layerNum = 0; layerNum < workspace.outputs.size(); layerNum++) {
+      bytes += workspace.outputs[layerNum].capacity() * sizeof(double);
+      bytes += workspace.gradients[layerNum].capacity() * sizeof(double);
+   }
+   long change = bytes - workspace.heldBytes;
+   workspace.heldBytes = bytes;
+
+   #pragma omp critical(activationMemory)
+   {
+      activationBytes += change;
+      peakActivationBytes = max(peakActivationBytes, activationBytes);
+   }
+}
+
+/*
+   Recompute the activations of layerNum, and of every layer between it and the
+   closest checkpointed layer below it, from that checkpoint.
+
+   In hogwild this thread has not updated the weights feeding these layers yet,
+   but other threads may have, so the result can differ slightly from the
+   original forward pass. This is the same staleness hogwild already accepts
+   between the forward and the backward pass. In a bulk synchronous round the
+   weights feeding these layers have not been updated by anyone yet, so the
+   result is identical, see applyRoundUpdates.
+*/
+void Network::recomputeActivations(int layerNum, HogwildWorkspace &workspace) {
+   int checkpoint = layerNum - 1;
+   while (workspace.outputs[checkpoint].empty()) {
+      checkpoint--;
+   }
+   for (int i = checkpoint + 1; i <= layerNum; i++) {
+      layers[i]->feedForwardInto(layers[i - 1], workspace.outputs[i - 1], workspace.outputs[i]);
+      trackActivationMemory(workspace);
+   }
+}
+
+/*
+   Propagate a sample through a workspace on a worker rank and compute the
+   output gradients using the softmax function. Ghost neuron outputs and the
+   other ranks' share of the softmax normalizer are taken from the last
+   synchronization. The output layer's activations are dropped once the output
+   gradients have been computed.
+
+   Input: checkpointing
+      Drop the activations of hidden layers that are not checkpointed as soon as
+      the next layer has been computed
+
+   Return: the squared error of this rank's outputs
+*/
+double Network::forwardSample(int sample, HogwildWorkspace &workspace, bool checkpointing) {
+   int numLayers = layers.size();
+   vector<vector<double> > &outputs = workspace.outputs;
+   vector<vector<double> > &gradients = workspace.gradients;
+
+   outputs[0] = inputData[sample % inputData.size()];
+   for (int layerNum = 1; layerNum < numLayers; layerNum++) {
+      layers[layerNum]->feedForwardInto(layers[layerNum - 1], outputs[layerNum - 1], outputs[layerNum]);
+      trackActivationMemory(workspace);
+      if (checkpointing && layerNum > 1 && !networkTopology[layerNum - 1].checkpoint) {
+         releaseActivations(outputs[layerNum - 1]);
+      }
+   }
+
+   vector<double> &yHat = outputs.back();
+   vector<double> &outputGradient = gradients.back();
+   vector<double> &yPred = outputData[sample % outputData.size()];
+   int numOutputs = yHat.size();
+   int offset = (myRank - 1) * numOutputs;
+
+   // remoteExpSum is relative to softmaxShift. This rank's outputs may have
+   // grown past it since the last synchronization, so shift by the larger of the two.
+   double shift = max(softmaxShift, *max_element(yHat.begin(), yHat.end()));
+   double totalExp = remoteExpSum * exp(softmaxShift - shift) + reduceExpSum(&yHat[0], numOutputs, shift);
+   outputGradient.resize(numOutputs);
+   trackActivationMemory(workspace);
+   double loss = 0;
+   for (int i = 0; i < numOutputs; i++) {
+      double gradVal = exp(yHat[i] - shift) / totalExp - yPred[offset + i];
+      outputGradient[i] = gradVal;
+      loss += gradVal * gradVal;
+   }
+   releaseActivations(yHat);
+   return loss / 2;
+}
+
+/*
+   One lock free training step on a worker rank. The sample is propagated through
+   the thread's own workspace and the resulting update is applied directly to the
+   shared weights.
+
+   Activations of hidden layers that are not checkpointed are dropped as soon as
+   the next layer has been computed and recomputed from the closest checkpoint
+   during back propagation. Every activation and gradient buffer is freed as soon
+   as it has been consumed, before the layers below are recomputed, so the
+   workspace holds nothing between samples.
+
+   The peak of a step is reached at the first hidden layer, which needs its own
+   activations and gradients and the gradients of the layer above at the same
+   time whether it was checkpointed or not. Checkpointing lowers what is held
+   during the forward pass. Its main saving is in bulk synchronous rounds, where the
+   activations of every sample of a round are held until the round ends, see
+   trainHogwild.
+
+   Return: the squared error of this rank's outputs
+*/
+double Network::hogwildStep(int sample, HogwildWorkspace &workspace) {
+   int numLayers = layers.size();
+   vector<vector<double> > &outputs = workspace.outputs;
+   vector<vector<double> > &gradients = workspace.gradients;
+
+   double loss = forwardSample(sample, workspace, true);
+
+   // Walk down the layers. The gradients of a hidden layer only depend on the
+   // weights feeding the layer above it, so those weights are updated right
+   // after and the activations and gradients above are no longer needed.
+   for (int layerNum = numLayers - 2; layerNum >= 0; layerNum--) {
+      if (outputs[layerNum].empty()) {
+         recomputeActivations(layerNum, workspace);
+      }
+      if (layerNum > 0) {
+         layers[layerNum]->calcHiddenGradientsInto(outputs[layerNum], gradients[layerNum + 1], gradients[layerNum]);
+         trackActivationMemory(workspace);
+      }
+
+      vector<Neuron*> layerNeurons = layers[layerNum]->getNeurons();
+      optimizer->updateLayer(layerNum + 1, layerNeurons, outputs[layerNum], gradients[layerNum + 1]);
+
+      releaseActivations(outputs[layerNum]);
+      releaseActivations(gradients[layerNum + 1]);
+      trackActivationMemory(workspace);
+   }
+
+   return loss;
+}
+
+/*
+   Reproducible counterpart of hogwildStep. Computes the gradients of every
+   layer for a sample without touching the weights, the update is applied later
+   by applyRoundUpdates. The gradients and the activations of checkpointed
+   layers are kept until then, the activations of the other hidden layers are
+   dropped once their gradients have been computed.
+
+   Return: the squared error of this rank's outputs
+*/
+double Network::sampleGradients(int sample, HogwildWorkspace &workspace) {
+   double loss = forwardSample(sample, workspace, false);
+   for (int layerNum = layers.size() - 2; layerNum > 0; layerNum--) {
+      layers[layerNum]->calcHiddenGradientsInto(workspace.outputs[layerNum], workspace.gradients[layerNum + 1], workspace.gradients[layerNum]);
+      trackActivationMemory(workspace);
+      if (!networkTopology[layerNum].checkpoint) {
+         releaseActivations(workspace.outputs[layerNum]);
+         trackActivationMemory(workspace);
+      }
+   }
+   return loss;
+}
+
+/*
+   Apply the updates computed by sampleGradients for the first count samples of
+   a round. The layers are updated from the top down and every layer with the
+   updates of all samples in sample order. Each weight therefore sees the same
+   sequence of updates as if the samples had been applied one after the other,
+   and the weights feeding a layer are still those of the start of the round
+   when the activations dropped by sampleGradients are recomputed. Recomputation
+   happens here one sample at a time, buffers are freed once consumed.
+*/
+void Network::applyRoundUpdates(int count) {
+   for (int layerNum = layers.size() - 2; layerNum >= 0; layerNum--) {
+      vector<Neuron*> layerNeurons = layers[layerNum]->getNeurons();
+      for (int s = 0; s < count; s++) {
+         HogwildWorkspace &workspace = workspaces[s];
+         if (workspace.outputs[layerNum].empty()) {
+            recomputeActivations(layerNum, workspace);
+         }
+         optimizer->updateLayer(layerNum + 1, layerNeurons, workspace.outputs[layerNum], workspace.gradients[layerNum + 1]);
+         releaseActivations(workspace.outputs[layerNum]);
+         releaseActivations(workspace.gradients[layerNum + 1]);
+         trackActivationMemory(workspace);
+      }
+   }
+}
+
+/*
+   Synchronize the ranks between hogwild rounds. The given sample is propagated
+   synchronously, which refreshes the ghost neurons, and the softmax normalizer
+   of each rank's outputs is shared with the other ranks.
+
+   Every rank contributes its largest output and the sum of exp(output) shifted
+   by it. The normalizer of the other ranks is kept relative to the largest
+   output over all ranks (softmaxShift) so exp() cannot overflow.
+*/
+void Network::synchronizeHogwild(int sample) {
+   int numOutputs = networkTopology.back().size;
+   double local[2] = {-HUGE_VAL, 0.0};
+   vector<double> all(2 * worldSize);
+
+   propagateSample(sample % inputData.size());
+   if (myRank > 0) {
+      local[0] = *max_element(localData, localData + numOutputs);
+      local[1] = reduceExpSum(localData, numOutputs, local[0]);
+   }
+   topology->allgather(local, 2, &all[0]);
+
+   // Rank 0 holds no outputs
+   softmaxShift = -HUGE_VAL;
+   for (int r = 1; r < worldSize; r++) {
+      softmaxShift = max(softmaxShift, all[2 * r]);
+   }
+   remoteExpSum = 0.0;
+   for (int r = 1; r < worldSize; r++) {
+      if (r != myRank) {
+         remoteExpSum += all[2 * r + 1] * exp(all[2 * r] - softmaxShift);
+      }
+   }
+}
+
 Network::Network() {
    sampleIndex = 0;
+   activationBytes = 0;
+   peakActivationBytes = 0;
+   optimizer = NULL;
+   ownsOptimizer = false;
+   remoteExpSum = 0.0;
+   softmaxShift = -HUGE_VAL;
+   evalComm = MPI_COMM_NULL;
+   evalPass.active = false;
+   evalPass.request = MPI_REQUEST_NULL;
+   evalPass.metrics = EvaluationMetrics();
+}
+
+Network::~Network() {
+   for (int i = 0; i < layers.size(); i++) {
+      delete layers[i];
+   }
+   if (ownsOptimizer) {
+      delete optimizer;
+   }
+   free(globalData);
+   globalData = NULL;
+   if (evalPass.request != MPI_REQUEST_NULL) {
+      MPI_Wait(&evalPass.request, MPI_STATUS_IGNORE);
+   }
+   if (evalComm != MPI_COMM_NULL) {
+      MPI_Comm_free(&evalComm);
+   }
 }
 
 /*
    Add layers to define the topology of the network
+
+   Input: _checkpoint
+      Whether hogwild training keeps this layer's activations for back propagation.
+      Activations of layers that are not checkpointed are recomputed instead.
+      Only affects hidden layers.
 */
-void Network::addLayer(const string &_type, const int &_size) {
+void Network::addLayer(const string &_type, const int &_size, const bool &_checkpoint) {
    if(_type == "input" || _type == "hidden" || _type == "output"){
       LayerTopology lyrTop = LayerTopology();
       lyrTop.size = _size;
       lyrTop.type = _type;
+      lyrTop.checkpoint = _checkpoint;
       networkTopology.push_back(lyrTop);
    }else{
       if(myRank == 0){
@@ -68,6 +430,14 @@ void Network::addLayer(const string &_type, const int &_size) {
    }
 }
 
+/*
+   Set the optimizer used to update the weights. Must be called before
+   initializeNetwork. Defaults to sgd with a learning rate of 0.001.
+*/
+void Network::setOptimizer(Optimizer *_optimizer) {
+   optimizer = _optimizer;
+}
+
 /*
    Once all layers have been added to construct the topology of the network,
    this function should be called to actaully build/initialize the network.
@@ -88,9 +458,60 @@ void Network::initializeNetwork(int size) {
       }
    }
 
+   initializeWeights(1);
+
+   // Only the worker ranks update weights so only they need optimizer state
+   if (optimizer == NULL) {
+      optimizer = new Optimizer("sgd", 0.001);
+      ownsOptimizer = true;
+   }
+   optimizer->initializeState(layers.size());
+   if (myRank > 0) {
+      for (int layerNum = 1; layerNum < layers.size(); layerNum++) {
+         optimizer->initializeLayerState(layerNum, layers[layerNum - 1]->getSize(), layers[layerNum]->getSize());
+      }
+   }
+
+   // Evaluation traffic is kept on its own communicator so it can never be
+   // matched against training messages
+   MPI_Comm_dup(MPI_COMM_WORLD, &evalComm);
+
    globalData = (double*)malloc(size * sizeof(double));
 }
 
+/*
+   Draw every weight, the ghost neurons' included, uniformly from
+   [-1/sqrt(fanIn), 1/sqrt(fanIn)] where fanIn is the number of neurons feeding
+   the next layer. This keeps the outputs of the linear layers of order one, with
+   constant weights they grow with the product of the layer sizes and the first
+   update saturates the softmax. Each rank uses its own stream derived from seed
+   so the same seed always gives the same network.
+*/
+void Network::initializeWeights(unsigned long long seed) {
+   unsigned long long state = (seed + myRank) * 0x9E3779B97F4A7C15ULL + 1;
+
+   for (int layerNum = 0; layerNum < layers.size() - 1; layerNum++) {
+      Layer *layer = layers[layerNum];
+      int numNext = layers[layerNum + 1]->getSize();
+      int fanIn = layer->getSize() + (layerNum > 0 ? 2 : 0);
+      double scale = 1.0 / sqrt((double)fanIn);
+
+      vector<Neuron*> neurons = layer->getNeurons();
+      neurons.push_back(layer->ghostNeuronTop);
+      neurons.push_back(layer->ghostNeuronBottom);
+      for (int i = 0; i < neurons.size(); i++) {
+         for (int j = 0; j < numNext; j++) {
+            // xorshift64*
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            double uniform = ((state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+            neurons[i]->setOutputWeightForIndex(j, scale * (2.0 * uniform - 1.0));
+         }
+      }
+   }
+}
+
 /*
    Reads the input file line by line and stores each input sample into inputData.
    Each input sample is split into a vector. Ex Input 1,0,1 --> Vec<1, 0, 1>
@@ -107,6 +528,10 @@ void Network::initializeNetwork(int size) {
          forward propgation.
 */
 void Network::loadTestingInputData(const string &inputDataLoc) {
+   readInputData(inputDataLoc, inputData);
+}
+
+void Network::readInputData(const string &inputDataLoc, vector<vector<double> > &data) {
 
    ifstream infile(inputDataLoc.c_str());
    string line;
@@ -120,7 +545,7 @@ void Network::loadTestingInputData(const string &inputDataLoc) {
             sample.push_back(((double)dataPoint - 48.0));
          }
       }
-      inputData.push_back(sample);
+      data.push_back(sample);
       sample.clear();
    }
 }
@@ -151,28 +576,54 @@ void Network::loadTestingOutputData(const string &outputDataLoc, const int &numC
    }
 }
 
-void Network::forwardPropagation() {
-   // Select a sample from the input data
-   int index = sampleIndex % inputData.size();
-   vector<double> inputSample = inputData[index];
+/*
+   Load the held out set scored by the evaluation passes. Same file formats as
+   the testing data, labels are kept as class indices rather than onehot vectors.
 
-   if (myRank > 0) {
+   Input: inputDataLoc
+      Location of the validation input data file
+   Input: outputDataLoc
+      Location of the validation labels file
+   Input: numClasses
+      Number of classes, labels must lie in [1, numClasses]
 
-      // Feed the sample input values into the neurons in the input layer
-      int inputLayerIndex = 0;
-      for (int value = 0; value < inputSample.size(); value++) {
-         layers[inputLayerIndex]->setOutputValueForNeuronAtIndex(value, inputSample[value]);
-      }
+   Aborts if the files cannot be read, the number of samples and labels differ,
+   a sample does not match the input layer or a label is out of range.
+*/
+void Network::loadValidationData(const string &inputDataLoc, const string &outputDataLoc, const int &numClasses) {
+   readInputData(inputDataLoc, validationInput);
 
-      // Forward Propogate
-      for (int layerNum = 1; layerNum < layers.size(); layerNum++) {
-         // cout << layers[layerNum].getType() << " Rank " << myRank << endl;
-         Layer *prevLayer = layers[layerNum - 1];
-         layers[layerNum]->feedForward(prevLayer);
-         // MPI_Barrier(MPI_COMM_WORLD);
-      }
+   ifstream infile(outputDataLoc.c_str());
+   string c;
+   while (getline(infile, c)) {
+      validationLabels.push_back(atoi(c.c_str()) - 1);
+   }
 
+   string error;
+   if (validationInput.empty()) {
+      error = "could not read validation samples from " + inputDataLoc;
+   } else if (validationInput.size() != validationLabels.size()) {
+      error = "the validation set has a different number of samples and labels";
+   }
+   for (int i = 0; i < validationInput.size() && error.empty(); i++) {
+      if (validationInput[i].size() != networkTopology[0].size) {
+         error = "a validation sample does not match the size of the input layer";
+      } else if (validationLabels[i] < 0 || validationLabels[i] >= numClasses) {
+         error = "a validation label is out of range";
+      }
+   }
+   if (!error.empty()) {
+      if (myRank == 0) {
+         cout << "Error: " << error << "." << "\n";
+      }
+      MPI_Abort(MPI_COMM_WORLD, 1);
    }
+}
+
+void Network::forwardPropagation() {
+   // Select a sample from the input data
+   int index = sampleIndex % inputData.size();
+   propagateSample(index);
    sampleIndex++;
 }
 
@@ -198,10 +649,11 @@ void Network::backwardPropagation() {
       }
 
       // Updated the weights
+      optimizer->beginStep();
       for (int layerNum = layers.size() - 1; layerNum > 0; layerNum--) {
          Layer *currentLayer = layers[layerNum];
          Layer *prevLayer = layers[layerNum - 1];
-         currentLayer->updateWeights(prevLayer, layerNum);
+         currentLayer->updateWeights(prevLayer, layerNum, optimizer);
       }
 
    }
@@ -210,43 +662,407 @@ void Network::backwardPropagation() {
 
 double Network::computeLoss(int size) {
    int outputsPerRank = networkTopology.back().size;
-   int ret = MPI_Allgather(&localData, outputsPerRank, MPI_DOUBLE, globalData, outputsPerRank, MPI_DOUBLE, MPI_COMM_WORLD);
+   topology->allgather(localData, outputsPerRank, globalData);
    double loss = 0;
 
+   // Rank 0 holds no outputs so its slot is skipped
+   vector<double> yHat;
+   for (int i = outputsPerRank; i < (outputsPerRank * (worldSize)); i++) {
+      yHat.push_back(globalData[i]);
+   }
+
+   // Compute gradient using softmax function
+   yHat = multiclassSigmoid(yHat);
+   vector<double> yPred = outputData[(sampleIndex - 1) % outputData.size()];
+   vector<double> yGradient;
+
+   for (int i = 0; i < yHat.size(); i++) {
+      double gradVal = -1 * (yPred[i] - yHat[i]);
+      yGradient.push_back(gradVal);
+   }
+
+   outputGradients = yGradient;
+   targetOutput = yPred;
+
+   for (int i = 0; i < yGradient.size(); i++) {
+      loss += yGradient[i] * yGradient[i];
+   }
+   loss = loss / 2;
+
+   return loss;
+}
+
+
+/*
+   Lock free asynchronous training (hogwild). On each worker rank numThreads
+   threads pull samples from a shared counter and apply their updates to the
+   layer weights without any locking. Races between threads are benign and
+   accepted. Every syncFrequency samples the ranks synchronize the ghost
+   neurons and the softmax normalizer, between rounds the threads train on
+   boundary values that are at most one round old. The learning rate schedule
+   advances once per round.
+
+   With rounds set the training is bulk synchronous instead: the samples of a
+   round are propagated in parallel against the weights at the start of the
+   round and their updates are applied one after the other in sample order, so
+   the weights after training do not depend on numThreads. This is a different
+   algorithm from lock free hogwild, train() uses it in reproducible mode. One
+   workspace is kept per sample of a round and holds the sample's gradients and
+   checkpointed activations until the round ends, the other activations are
+   recomputed when the updates are applied. This is where checkpointing saves
+   the most memory.
+
+   Input: numSamples
+      Number of samples to train on
+   Input: numThreads
+      Number of threads per rank. Requires OpenMP, otherwise runs on one thread.
+   Input: syncFrequency
+      Number of samples between synchronizations of the ranks
+   Input: rounds
+      Train in bulk synchronous rounds rather than lock free
+
+   Return: mean loss per sample across all ranks
+*/
+double Network::trainHogwild(int numSamples, int numThreads, int syncFrequency, bool rounds) {
+   int numLayers = layers.size();
+   int firstSample = sampleIndex;
+   int lastSample = sampleIndex + numSamples;
+   double localLoss = 0.0;
+   double totalLoss = 0.0;
+
+   if (syncFrequency < 1) {
+      syncFrequency = 1;
+   }
+   if (numThreads < 1) {
+      numThreads = 1;
+   }
+   int numWorkspaces = rounds ? syncFrequency : numThreads;
+   if (workspaces.size() < numWorkspaces) {
+      workspaces.resize(numWorkspaces);
+   }
+   for (int t = 0; t < numWorkspaces; t++) {
+      workspaces[t].outputs.resize(numLayers);
+      workspaces[t].gradients.resize(numLayers);
+   }
+   vector<double> sampleLoss(syncFrequency);
+
+   for (int roundStart = firstSample; roundStart < lastSample; roundStart += syncFrequency) {
+      int roundEnd = min(roundStart + syncFrequency, lastSample);
+      int next = roundStart;
+
+      synchronizeHogwild(roundStart);
+      optimizer->beginStep();
+
+      if (myRank > 0 && rounds) {
+         int count = roundEnd - roundStart;
+         #pragma omp parallel for num_threads(numThreads) schedule(static)
+         for (int s = 0; s < count; s++) {
+            sampleLoss[s] = sampleGradients(roundStart + s, workspaces[s]);
+         }
+         for (int s = 0; s < count; s++) {
+            localLoss += sampleLoss[s];
+         }
+         applyRoundUpdates(count);
+      } else if (myRank > 0) {
+         #pragma omp parallel num_threads(numThreads) reduction(+:localLoss)
+         {
+            int thread = 0;
+#ifdef _OPENMP
+            thread = omp_get_thread_num();
+#endif
+            while (true) {
+               int sample;
+               #pragma omp atomic capture
+               sample = next++;
+               if (sample >= roundEnd) {
+                  break;
+               }
+               localLoss += hogwildStep(sample, workspaces[thread]);
+            }
+         }
+      }
+   }
+   sampleIndex = lastSample;
+
+   topology->allreduce(&localLoss, 1, &totalLoss);
+   return totalLoss / numSamples;
+}
 
-   if (ret == MPI_SUCCESS) {
-      vector<double> yHat;
-      // for (int i = outputsPerRank; i < (outputsPerRank * (worldSize)); i++) {
-      //    yHat.push_back(globalData[i]);
-      // }
+/*
+   Forward propagate a batch of validation samples on a worker rank with the
+   weights of the current evaluation pass. Samples in the batch are propagated
+   by numThreads threads one layer at a time, after each layer the ghost neuron
+   outputs of the whole batch are exchanged at once. Nothing is written to the
+   neurons or the weights. Only the activations of the
+   current and previous layer are kept, batchOutputs[b][layerNum % 2].
+*/
+void Network::forwardBatch(int batchStart, int count, int numThreads, vector<vector<vector<double> > > &batchOutputs) {
+   int numLayers = layers.size();
+   vector<double> ghostTops(count, 0.0);
+   vector<double> ghostBottoms(count, 0.0);
+   vector<double> firstOutputs(count);
+   vector<double> lastOutputs(count);
+#ifndef _OPENMP
+   (void)numThreads;
+#endif
+
+   for (int b = 0; b < count; b++) {
+      batchOutputs[b][0] = validationInput[batchStart + b];
+   }
 
-      // Debug
-      for (int i = 0; i < (outputsPerRank * (worldSize - 1)); i++) {
-         outputGradients.push_back(0.0);
+   for (int layerNum = 1; layerNum < numLayers; layerNum++) {
+      #pragma omp parallel for num_threads(numThreads)
+      for (int b = 0; b < count; b++) {
+         layers[layerNum]->feedForwardFrom(&evalPass.weights[layerNum - 1][0], batchOutputs[b][(layerNum - 1) % 2], ghostTops[b], ghostBottoms[b], batchOutputs[b][layerNum % 2]);
       }
 
-      // Compute gradient using softmax function
-      yHat = multiclassSigmoid(yHat);
-      vector<double> yPred = outputData[sampleIndex - 1];
-      vector<double> yGradient;
+      for (int b = 0; b < count; b++) {
+         firstOutputs[b] = batchOutputs[b][layerNum % 2].front();
+         lastOutputs[b] = batchOutputs[b][layerNum % 2].back();
+      }
+      layers[layerNum]->exchangeGhostOutputs(firstOutputs, lastOutputs, ghostTops, ghostBottoms, evalComm);
+   }
+}
+
+/*
+   Combine the per rank records of a batch into the running metrics. Each rank
+   contributes one record per sample: its largest output, the sum of exp(output)
+   shifted by that largest output, the output for the target class if this rank
+   owns it, and its topK largest outputs.
+
+   A rank whose outputs are not all finite reports NaN as its largest output.
+   Such samples are counted in numNonFinite and make the cross-entropy NaN, they
+   never count as hits.
+*/
+void Network::accumulateMetrics(vector<double> &records, int count, int topK, EvaluationMetrics &metrics) {
+   int recordSize = topK + 3;
+   vector<double> candidates;
+
+   for (int b = 0; b < count; b++) {
+      double maxOutput = -HUGE_VAL;
+      double target = -HUGE_VAL;
+      bool finite = true;
+      for (int r = 1; r < worldSize; r++) {
+         double *record = &records[(r * count + b) * recordSize];
+         if (!isfinite(record[0])) {
+            finite = false;
+         }
+         maxOutput = max(maxOutput, record[0]);
+         target = max(target, record[2]);
+      }
+
+      if (!finite) {
+         metrics.numNonFinite++;
+         metrics.crossEntropy += NAN;
+         continue;
+      }
 
-      for (int i = 0; i < yHat.size(); i++) {
-         double gradVal = -1 * (yPred[i] - yHat[i]);
-         yGradient.push_back(gradVal);
+      double totalExp = 0.0;
+      candidates.clear();
+      for (int r = 1; r < worldSize; r++) {
+         double *record = &records[(r * count + b) * recordSize];
+         totalExp += record[1] * exp(record[0] - maxOutput);
+         candidates.insert(candidates.end(), record + 3, record + recordSize);
       }
+      nth_element(candidates.begin(), candidates.begin() + (topK - 1), candidates.end(), greater<double>());
+      double kthOutput = candidates[topK - 1];
 
-      outputGradients = yGradient;
-      targetOutput = yPred;
+      // A target that no rank owns is never a hit
+      if (isfinite(target) && target >= maxOutput) {
+         metrics.top1Accuracy += 1;
+      }
+      if (isfinite(target) && target >= kthOutput) {
+         metrics.topKAccuracy += 1;
+      }
+      metrics.crossEntropy += log(totalExp) + maxOutput - target;
+   }
+   metrics.numSamples += count;
+}
 
-      for (int i = 0; i < yGradient.size(); i++) {
-         loss += yGradient[i] * yGradient[i];
+/*
+   Copy the weights feeding every layer, weights[layerNum - 1] for layer
+   layerNum, in the layout read by Layer::feedForwardFrom: one row per neuron of
+   the previous layer followed by the rows of its two ghost neurons.
+*/
+void Network::snapshotWeights(vector<vector<double> > &weights) {
+   weights.resize(layers.size() - 1);
+   for (int layerNum = 0; layerNum < layers.size() - 1; layerNum++) {
+      vector<Neuron*> neurons = layers[layerNum]->getNeurons();
+      neurons.push_back(layers[layerNum]->ghostNeuronTop);
+      neurons.push_back(layers[layerNum]->ghostNeuronBottom);
+      int numNext = layers[layerNum + 1]->getSize();
+      weights[layerNum].resize((long)neurons.size() * numNext);
+      for (int i = 0; i < neurons.size(); i++) {
+         Connection *connections = neurons[i]->getOutputWeightData();
+         double *row = &weights[layerNum][(long)i * numNext];
+         for (int j = 0; j < numNext; j++) {
+            row[j] = connections[j].weight;
+         }
       }
-      loss = loss / 2;
    }
+}
 
-   return loss;
+/*
+   Start scoring the validation set against the current weights. Collective, no
+   evaluation pass may be in progress. The weights are copied so training can
+   continue while the pass is advanced with advanceEvaluation, the copy is freed
+   when the pass ends.
+
+   Input: batchSize
+      Number of validation samples propagated together
+   Input: topK
+      k for the top-k accuracy
+*/
+void Network::beginEvaluation(int batchSize, int topK) {
+   int recordSize = topK + 3;
+   evalPass.active = true;
+   evalPass.batchSize = batchSize;
+   evalPass.topK = topK;
+   evalPass.nextSample = 0;
+   evalPass.pendingCount = 0;
+   evalPass.buffer = 0;
+   evalPass.metrics = EvaluationMetrics();
+   if (myRank > 0) {
+      snapshotWeights(evalPass.weights);
+   }
+   evalPass.batchOutputs.assign(batchSize, vector<vector<double> >(2));
+   for (int i = 0; i < 2; i++) {
+      evalPass.localRecords[i].resize(batchSize * recordSize);
+      evalPass.allRecords[i].resize(batchSize * recordSize * worldSize);
+   }
+}
+
+/*
+   Advance the evaluation pass by one batch. Collective. Nothing is written to
+   the weights or the neuron state.
+
+   The batch is propagated forward only and its per sample records are gathered
+   with a non-blocking allgather on a dedicated communicator. The gather is only
+   completed by the next call, so when the calls are made between training
+   iterations it overlaps a whole iteration. Every rank reduces the records to
+   the same metrics.
+
+   Input: numThreads
+      Number of threads per rank. Requires OpenMP, otherwise runs on one thread.
+
+   Return: true once the whole set has been scored, the metrics are then
+           available from getEvaluationMetrics
+*/
+bool Network::advanceEvaluation(int numThreads) {
+   int numLayers = layers.size();
+   int numOutputs = networkTopology.back().size;
+   int offset = (myRank - 1) * numOutputs;
+   int topK = evalPass.topK;
+   int recordSize = topK + 3;
+   int batchStart = evalPass.nextSample;
+   int count = min(evalPass.batchSize, (int)validationInput.size() - batchStart);
+   vector<double> &records = evalPass.localRecords[evalPass.buffer];
+
+   if (count > 0 && myRank > 0) {
+      forwardBatch(batchStart, count, numThreads, evalPass.batchOutputs);
+
+      for (int b = 0; b < count; b++) {
+         vector<double> &yHat = evalPass.batchOutputs[b][(numLayers - 1) % 2];
+         double *record = &records[b * recordSize];
+         double maxOutput = *max_element(yHat.begin(), yHat.end());
+         for (int i = 0; i < numOutputs; i++) {
+            if (!isfinite(yHat[i])) {
+               maxOutput = NAN;
+            }
+         }
+         double sumExp = reduceExpSum(&yHat[0], numOutputs, maxOutput);
+         int label = validationLabels[batchStart + b];
+         record[0] = maxOutput;
+         record[1] = sumExp;
+         record[2] = (label >= offset && label < offset + numOutputs) ? yHat[label - offset] : -HUGE_VAL;
+         int numTop = min(topK, numOutputs);
+         partial_sort_copy(yHat.begin(), yHat.end(), record + 3, record + 3 + numTop, greater<double>());
+         for (int k = numTop; k < topK; k++) {
+            record[3 + k] = -HUGE_VAL;
+         }
+      }
+   } else if (count > 0) {
+      // Rank 0 holds no outputs but takes part in the gather
+      for (int i = 0; i < count * recordSize; i++) {
+         records[i] = -HUGE_VAL;
+      }
+   }
+
+   // Finish the previous batch before starting the gather for this one
+   if (evalPass.request != MPI_REQUEST_NULL) {
+      double startTimeComm = MPI_Wtime();
+      MPI_Wait(&evalPass.request, MPI_STATUS_IGNORE);
+      commWaitTime += MPI_Wtime() - startTimeComm;
+      accumulateMetrics(evalPass.allRecords[1 - evalPass.buffer], evalPass.pendingCount, topK, evalPass.metrics);
+   }
+
+   if (count > 0) {
+      commBytes += count * recordSize * sizeof(double);
+      MPI_Iallgather(&records[0], count * recordSize, MPI_DOUBLE, &evalPass.allRecords[evalPass.buffer][0], count * recordSize, MPI_DOUBLE, evalComm, &evalPass.request);
+      evalPass.pendingCount = count;
+      evalPass.buffer = 1 - evalPass.buffer;
+      evalPass.nextSample += count;
+      return false;
+   }
+
+   EvaluationMetrics &metrics = evalPass.metrics;
+   if (metrics.numSamples > 0) {
+      metrics.top1Accuracy /= metrics.numSamples;
+      metrics.topKAccuracy /= metrics.numSamples;
+      metrics.crossEntropy /= metrics.numSamples;
+   }
+   vector<vector<double> >().swap(evalPass.weights);
+   evalPass.active = false;
+   return true;
+}
+
+bool Network::isEvaluating() {
+   return evalPass.active;
+}
+
+// Metrics of the last finished evaluation pass
+EvaluationMetrics Network::getEvaluationMetrics() {
+   return evalPass.metrics;
 }
 
+/*
+   Print the peak memory of every rank: the peak resident set size of the process
+   and the most bytes the hogwild activation and gradient buffers of all threads
+   held at the same time. Collective, the output is printed by rank 0.
+*/
+void Network::printMemoryUsage() {
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+
+   // ru_maxrss is reported in kilobytes
+   double local[2];
+   local[0] = usage.ru_maxrss / 1024.0;
+   local[1] = peakActivationBytes / (1024.0 * 1024.0);
+
+   vector<double> all(2 * worldSize);
+   MPI_Gather(local, 2, MPI_DOUBLE, &all[0], 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+   if (myRank == 0) {
+      for (int r = 0; r < worldSize; r++) {
+         printf("Rank: %d Peak RSS: %.2f MB Peak Activations: %.2f MB\n", r, all[2 * r], all[2 * r + 1]);
+      }
+   }
+}
+
+// Copy of every weight held by this rank, layer by layer and row major by neuron
+vector<double> Network::getWeights() {
+   vector<double> weights;
+   for (int layerNum = 0; layerNum < layers.size() - 1; layerNum++) {
+      vector<Neuron*> neurons = layers[layerNum]->getNeurons();
+      int numNext = layers[layerNum + 1]->getSize();
+      for (int i = 0; i < neurons.size(); i++) {
+         Connection *connections = neurons[i]->getOutputWeightData();
+         for (int j = 0; j < numNext; j++) {
+            weights.push_back(connections[j].weight);
+         }
+      }
+   }
+   return weights;
+}
 
 void Network::printNetworkInfo() {
    cout << "----------------------" << endl;
@@ -255,11 +1071,13 @@ void Network::printNetworkInfo() {
    for (int i = 0; i < layers.size(); i++) {
       string layerType = layers[i]->getType();
       int layerSize = layers[i]->getSize();
-      printf("  Type: %s Size: %d\n", layerType.c_str(), layerSize);
+      printf("  Type: %s Size: %d Checkpoint: %s\n", layerType.c_str(), layerSize, networkTopology[i].checkpoint ? "yes" : "no");
    }
+   cout << "Checkpointing only applies to hogwild training, sync mode keeps every activation." << endl;
    cout << "----------------------" << endl;
 }
 
+// The deltas are only recorded when the optimizer was told to, see Optimizer::setRecordDeltas
 void Network::printLayerWeights(int layerIndex) {
    vector<Neuron*> neurons = layers[layerIndex]->getNeurons();
    for (int i = 0; i < neurons.size(); i++) {
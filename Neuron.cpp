@@ -14,27 +14,28 @@ private:
    int index;
    double output;
    double gradient;
-   double eta;
    bool isGhost;
    vector<Connection> outputWeights;
-   double sigmoid(double x);
-   double sigmoidDerivative(double x);
 public:
+   static double sigmoid(double x);
+   static double sigmoidDerivative(double x);
    Neuron(int numOutputs, int _index);
    void setOutput(double value);
    void setGradient(double value);
    double getOutput();
+   double getGradient();
    int getIndex();
    vector<Connection> getOutputWeights();
+   Connection *getOutputWeightData();
+   double dotOutputWeights(const double *values, int n);
    void feedForward(vector<Neuron*> &prevLayerNeurons, int layerIndex, Neuron *ghostNeuronTop, Neuron *ghostNeuronBottom);
    void calcHiddenGradients(vector<Neuron*> &nextLayerNeurons, Neuron *ghostNeuronTop, Neuron *ghostNeuronBottom);
-   void updateWeights(vector<Neuron*> &prevLayerNeurons, Neuron *ghostNeuronTop, Neuron *ghostNeuronBottom, int layerNum);
    double sumOutputValues(vector<Neuron*> &nextLayerNeurons, Neuron *ghostNeuronTop, Neuron * ghostNeuronBottom);
    void setOutputWeightForIndex(int index, double _weight);
    void setOutputDeltaWeightForIndex(int index, double _dweight);
 };
 
-// Private Methods
+// Activation functions
 double Neuron::sigmoid(double x) {
    double expVal = exp(-x);
    return 1.0 / (1.0 + expVal);
@@ -57,7 +58,6 @@ double Neuron::sigmoidDerivative(double x) {
 */
 Neuron::Neuron(int numOutputs, int _index) {
    output = 0.0;  // Default neuron value is set to 0.0
-   eta = 0.001;  // Default learning rate
    for (int connection = 0; connection < numOutputs; connection++) {
       Connection c = Connection();
       c.weight = 0.1;
@@ -83,6 +83,10 @@ double Neuron::getOutput() {
    return output;
 }
 
+double Neuron::getGradient() {
+   return gradient;
+}
+
 
 vector<Connection> Neuron::getOutputWeights() {
    vector<Connection> _outputWeights;
@@ -93,6 +97,19 @@ vector<Connection> Neuron::getOutputWeights() {
    return _outputWeights;
 }
 
+// Direct access to the outgoing connections so the optimizer can update them in place
+Connection *Neuron::getOutputWeightData() {
+   return outputWeights.empty() ? NULL : &outputWeights[0];
+}
+
+// Sum of outputWeights[j].weight * values[j] over [0..n). See Reduction.cpp.
+double Neuron::dotOutputWeights(const double *values, int n) {
+   if (n == 0) {
+      return 0.0;
+   }
+   return reduceDot(&outputWeights[0].weight, sizeof(Connection) / sizeof(double), values, n);
+}
+
 int Neuron::getIndex() {
    return index;
 }
@@ -107,15 +124,17 @@ void Neuron::setOutputDeltaWeightForIndex(int index, double _dweight) {
 
 
 void Neuron::feedForward(vector<Neuron*> &prevLayerNeurons, int layerIndex, Neuron *ghostNeuronTop, Neuron *ghostNeuronBottom) {
-   double sum = 0.0;
+   // Fixed order blocked sum, see Reduction.cpp
+   double lanes[REDUCTION_LANES] = {0};
    for (int i = 0; i < prevLayerNeurons.size(); i++) {
-      sum += prevLayerNeurons[i]->getOutput() *
-             prevLayerNeurons[i]->getOutputWeights()[index].weight;
+      lanes[i % REDUCTION_LANES] += prevLayerNeurons[i]->getOutput() *
+                                    prevLayerNeurons[i]->getOutputWeightData()[index].weight;
    }
+   double sum = combineLanes(lanes);
 
    if (layerIndex > 1) {
-      sum += ghostNeuronTop->getOutput() * ghostNeuronTop->getOutputWeights()[index].weight;
-      sum += ghostNeuronBottom->getOutput() * ghostNeuronBottom->getOutputWeights()[index].weight;
+      sum += ghostNeuronTop->getOutput() * ghostNeuronTop->getOutputWeightData()[index].weight;
+      sum += ghostNeuronBottom->getOutput() * ghostNeuronBottom->getOutputWeightData()[index].weight;
    }
 
    // Use the sigmoid activation function
@@ -132,43 +151,23 @@ void Neuron::feedForward(vector<Neuron*> &prevLayerNeurons, int layerIndex, Neur
 }
 
 double Neuron::sumOutputValues(vector<Neuron*> &nextLayerNeurons, Neuron *ghostNeuronTop, Neuron *ghostNeuronBottom) {
-   double sum = 0.0;
+   Connection *topWeights = ghostNeuronTop->getOutputWeightData();
+   Connection *bottomWeights = ghostNeuronBottom->getOutputWeightData();
 
-   // Sum the contribution of errors at the node that are feedForward
+   // Sum the contribution of errors at the node that are feedForward and the
+   // ghost neuron errors as two fixed order blocked sums, see Reduction.cpp
+   double lanes[REDUCTION_LANES] = {0};
+   double ghostLanes[REDUCTION_LANES] = {0};
    for (int i = 0; i < nextLayerNeurons.size(); i++) {
-      sum += outputWeights[i].weight * nextLayerNeurons[i]->gradient;
-   }
-   // Sum up ghost neuron errors
-   for (int i = 0; i < nextLayerNeurons.size(); i++) {
-      sum += ghostNeuronTop->getOutputWeights()[i].weight * nextLayerNeurons[i]->gradient;
-      sum += ghostNeuronBottom->getOutputWeights()[i].weight * nextLayerNeurons[i]->gradient;
+      double nextGradient = nextLayerNeurons[i]->gradient;
+      lanes[i % REDUCTION_LANES] += outputWeights[i].weight * nextGradient;
+      ghostLanes[i % REDUCTION_LANES] += topWeights[i].weight * nextGradient + bottomWeights[i].weight * nextGradient;
    }
 
-   return sum;
+   return combineLanes(lanes) + combineLanes(ghostLanes);
 }
 
 void Neuron::calcHiddenGradients(vector<Neuron*> &nextLayerNeurons, Neuron *ghostNeuronTop, Neuron *ghostNeuronBottom) {
    double dow = sumOutputValues(nextLayerNeurons, ghostNeuronTop, ghostNeuronBottom);
    gradient = dow * sigmoidDerivative(output);
 }
-
-void Neuron::updateWeights(vector<Neuron*> &prevLayerNeurons, Neuron *ghostNeuronTop, Neuron *ghostNeuronBottom, int layerNum) {
-   for (int i = 0; i < prevLayerNeurons.size(); i++) {
-      Neuron *neuron = prevLayerNeurons[i];
-      double oldDeltaWeight = neuron->outputWeights[index].deltaWeight;
-      double newDeltaWeight = eta * neuron->getOutput() * gradient + oldDeltaWeight;
-
-      neuron->setOutputDeltaWeightForIndex(index, newDeltaWeight);
-
-      double oldW = neuron->outputWeights[index].weight;
-      double newW = oldW + newDeltaWeight;
-
-      neuron->setOutputWeightForIndex(index, newW);
-
-      double current = neuron->getOutputWeights()[index].weight;
-      neuron->outputWeights[index].deltaWeight = newDeltaWeight;
-      neuron->outputWeights[index].weight += newDeltaWeight;
-
-   }
-
-}
@@ -0,0 +1,285 @@
+/*
+   Class to represent the optimizer used to update the weights of the network
+
+   The optimizer state (velocities, moment estimates) for the connections feeding
+   layer L is stored in one contiguous buffer per layer, laid out row major by
+   neuron in layer L-1: state[prevNeuron * layerSize + neuron]. This matches the
+   layout of each neuron's outputWeights so a whole layer is updated in a single
+   pass over memory regardless of which optimizer is selected.
+*/
+
+using namespace std;
+
+class Optimizer {
+private:
+   string type;
+   int kind;
+   double eta;
+   double learningRate;
+   double momentum;
+   double beta1;
+   double beta2;
+   double epsilon;
+   double weightDecay;
+   string schedule;
+   int stepSize;
+   double decayRate;
+   int step;
+   bool recordDeltas;
+   double biasCorrection1;
+   double biasCorrection2;
+   vector<vector<double> > firstMoments;
+   vector<vector<double> > secondMoments;
+   double scheduledLearningRate();
+public:
+   Optimizer(const string &_type, const double &_eta);
+   void setMomentum(const double &_momentum);
+   void setAdamParameters(const double &_beta1, const double &_beta2, const double &_epsilon);
+   void setWeightDecay(const double &_weightDecay);
+   void setSchedule(const string &_schedule, const int &_stepSize, const double &_decayRate);
+   void setRecordDeltas(const bool &_recordDeltas);
+   void initializeState(int numLayers);
+   void initializeLayerState(int layerNum, int numPrevNeurons, int numNeurons);
+   void beginStep();
+   void updateLayer(int layerNum, vector<Neuron*> &prevLayerNeurons, const vector<double> &inputs, const vector<double> &gradients);
+   string getType();
+   double getLearningRate();
+   int getStep();
+};
+
+// Optimizer kinds. Resolved once from the type string so the update kernel
+// does not compare strings per weight.
+const int OPTIMIZER_SGD = 0;
+const int OPTIMIZER_MOMENTUM = 1;
+const int OPTIMIZER_NESTEROV = 2;
+const int OPTIMIZER_ADAM = 3;
+
+// Private Methods
+double Optimizer::scheduledLearningRate() {
+   if (schedule == "step") {
+      return eta * pow(decayRate, (double)(step / stepSize));
+   } else if (schedule == "exponential") {
+      return eta * exp(-decayRate * step);
+   } else if (schedule == "inverse") {
+      return eta / (1.0 + decayRate * step);
+   }
+   return eta;
+}
+
+/*
+   Construct an optimizer
+
+   Input: _type
+      The update rule to use (sgd, momentum, nesterov, adam)
+   Input: _eta
+      The base learning rate
+
+   Return: Optimizer object
+*/
+Optimizer::Optimizer(const string &_type, const double &_eta) {
+   type = _type;
+   eta = _eta;
+   learningRate = _eta;
+   momentum = 0.9;
+   beta1 = 0.9;
+   beta2 = 0.999;
+   epsilon = 1e-8;
+   weightDecay = 0.0;
+   schedule = "constant";
+   stepSize = 1;
+   decayRate = 1.0;
+   step = 0;
+   recordDeltas = false;
+   biasCorrection1 = 1.0;
+   biasCorrection2 = 1.0;
+
+   if (type == "sgd") {
+      kind = OPTIMIZER_SGD;
+   } else if (type == "momentum") {
+      kind = OPTIMIZER_MOMENTUM;
+   } else if (type == "nesterov") {
+      kind = OPTIMIZER_NESTEROV;
+   } else if (type == "adam") {
+      kind = OPTIMIZER_ADAM;
+   } else {
+      if (myRank == 0) {
+         cout << "Error: " << type << " is not a valid optimizer. Valid optimizers are sgd, momentum, nesterov, and adam." << "\n";
+      }
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+}
+
+void Optimizer::setMomentum(const double &_momentum) {
+   momentum = _momentum;
+}
+
+void Optimizer::setAdamParameters(const double &_beta1, const double &_beta2, const double &_epsilon) {
+   beta1 = _beta1;
+   beta2 = _beta2;
+   epsilon = _epsilon;
+}
+
+// L2 penalty added to the gradient of every weight
+void Optimizer::setWeightDecay(const double &_weightDecay) {
+   weightDecay = _weightDecay;
+}
+
+/*
+   Set the learning rate schedule
+
+   Input: _schedule
+      constant:    eta
+      step:        eta * decayRate^(step / stepSize)
+      exponential: eta * exp(-decayRate * step)
+      inverse:     eta / (1 + decayRate * step)
+   Input: _stepSize
+      Number of steps between decays for the step schedule
+   Input: _decayRate
+      Decay factor used by the schedule
+*/
+void Optimizer::setSchedule(const string &_schedule, const int &_stepSize, const double &_decayRate) {
+   if (_schedule != "constant" && _schedule != "step" && _schedule != "exponential" && _schedule != "inverse") {
+      if (myRank == 0) {
+         cout << "Error: " << _schedule << " is not a valid schedule. Valid schedules are constant, step, exponential, and inverse." << "\n";
+      }
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+   schedule = _schedule;
+   stepSize = _stepSize > 0 ? _stepSize : 1;
+   decayRate = _decayRate;
+}
+
+/*
+   Debugging aid. Store the change made to every weight in Connection::deltaWeight
+   (see Network::printLayerWeights). Off by default, the update kernels never
+   write deltaWeight themselves so a normal update only touches the weights and
+   the optimizer state.
+*/
+void Optimizer::setRecordDeltas(const bool &_recordDeltas) {
+   recordDeltas = _recordDeltas;
+}
+
+void Optimizer::initializeState(int numLayers) {
+   firstMoments.resize(numLayers);
+   secondMoments.resize(numLayers);
+}
+
+/*
+   Allocate the state buffers for the connections feeding layerNum. Plain SGD
+   keeps no state, momentum and nesterov keep a velocity and adam keeps both
+   moment estimates.
+*/
+void Optimizer::initializeLayerState(int layerNum, int numPrevNeurons, int numNeurons) {
+   int numWeights = numPrevNeurons * numNeurons;
+   if (kind != OPTIMIZER_SGD) {
+      firstMoments[layerNum].assign(numWeights, 0.0);
+   }
+   if (kind == OPTIMIZER_ADAM) {
+      secondMoments[layerNum].assign(numWeights, 0.0);
+   }
+}
+
+// Called once per update before any layer is updated. Advances the step count
+// and computes the per step constants shared by every layer.
+void Optimizer::beginStep() {
+   learningRate = scheduledLearningRate();
+   step++;
+   if (kind == OPTIMIZER_ADAM) {
+      biasCorrection1 = 1.0 - pow(beta1, (double)step);
+      biasCorrection2 = 1.0 - pow(beta2, (double)step);
+   }
+}
+
+/*
+   Update every weight feeding the current layer in one pass.
+
+   Input: layerNum
+      Index of the layer whose incoming weights are updated
+   Input: prevLayerNeurons
+      Neurons of the previous layer. Their outputWeights hold the weights.
+   Input: inputs
+      The output of each neuron in the previous layer
+   Input: gradients
+      The gradient of each neuron in the current layer
+
+   In hogwild mode several threads call this concurrently on the same layer.
+   The weight and state updates are deliberately unsynchronized.
+*/
+void Optimizer::updateLayer(int layerNum, vector<Neuron*> &prevLayerNeurons, const vector<double> &inputs, const vector<double> &gradients) {
+   int numNeurons = gradients.size();
+   const double *grad = &gradients[0];
+   double lr = learningRate;
+   double mu = momentum;
+   double wd = weightDecay;
+   double b1 = beta1;
+   double b2 = beta2;
+   double eps = epsilon;
+   double stepScale = learningRate / biasCorrection1;
+   double invCorrection2 = 1.0 / biasCorrection2;
+
+   for (int i = 0; i < prevLayerNeurons.size(); i++) {
+      double input = inputs[i];
+      Connection *weights = prevLayerNeurons[i]->getOutputWeightData();
+      double *m = kind != OPTIMIZER_SGD ? &firstMoments[layerNum][i * numNeurons] : NULL;
+      double *v = kind == OPTIMIZER_ADAM ? &secondMoments[layerNum][i * numNeurons] : NULL;
+
+      if (recordDeltas) {
+         for (int j = 0; j < numNeurons; j++) {
+            weights[j].deltaWeight = weights[j].weight;
+         }
+      }
+
+      switch (kind) {
+      case OPTIMIZER_SGD:
+         for (int j = 0; j < numNeurons; j++) {
+            double g = input * grad[j] + wd * weights[j].weight;
+            double delta = -lr * g;
+            weights[j].weight += delta;
+         }
+         break;
+      case OPTIMIZER_MOMENTUM:
+         for (int j = 0; j < numNeurons; j++) {
+            double g = input * grad[j] + wd * weights[j].weight;
+            m[j] = mu * m[j] + g;
+            double delta = -lr * m[j];
+            weights[j].weight += delta;
+         }
+         break;
+      case OPTIMIZER_NESTEROV:
+         for (int j = 0; j < numNeurons; j++) {
+            double g = input * grad[j] + wd * weights[j].weight;
+            m[j] = mu * m[j] + g;
+            double delta = -lr * (g + mu * m[j]);
+            weights[j].weight += delta;
+         }
+         break;
+      case OPTIMIZER_ADAM:
+         for (int j = 0; j < numNeurons; j++) {
+            double g = input * grad[j] + wd * weights[j].weight;
+            m[j] = b1 * m[j] + (1.0 - b1) * g;
+            v[j] = b2 * v[j] + (1.0 - b2) * g * g;
+            double delta = -stepScale * m[j] / (sqrt(v[j] * invCorrection2) + eps);
+            weights[j].weight += delta;
+         }
+         break;
+      }
+
+      if (recordDeltas) {
+         for (int j = 0; j < numNeurons; j++) {
+            weights[j].deltaWeight = weights[j].weight - weights[j].deltaWeight;
+         }
+      }
+   }
+}
+
+string Optimizer::getType() {
+   return type;
+}
+
+double Optimizer::getLearningRate() {
+   return learningRate;
+}
+
+int Optimizer::getStep() {
+   return step;
+}
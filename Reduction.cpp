@@ -0,0 +1,65 @@
+/*
+   Summation helpers used by the network
+
+   Floating point addition is not associative, so the result of a sum depends on
+   the order in which its terms are added. In reproducible mode (the global
+   reproducibleReductions) every sum is a fixed order blocked reduction: term i
+   is added to partial sum i % REDUCTION_LANES and the partial sums are combined
+   in a fixed pairwise tree. The result only depends on the terms, not on the
+   number of threads, the vector width or the compiler, and the blocked loop
+   still vectorizes.
+
+   In fast mode the compiler is free to reorder the terms.
+*/
+
+using namespace std;
+
+const int REDUCTION_LANES = 8;
+
+// Combine the partial sums of a blocked reduction in a fixed order
+double combineLanes(const double *lanes) {
+   return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+          ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+// Sum of a[i * strideA] * b[i] over [0..n), a may point into an array of structs
+double reduceDot(const double *a, int strideA, const double *b, int n) {
+   if (!reproducibleReductions) {
+      double sum = 0.0;
+      #pragma omp simd reduction(+:sum)
+      for (int i = 0; i < n; i++) {
+         sum += a[i * strideA] * b[i];
+      }
+      return sum;
+   }
+
+   double lanes[REDUCTION_LANES] = {0};
+   int blocked = n - n % REDUCTION_LANES;
+   for (int i = 0; i < blocked; i += REDUCTION_LANES) {
+      for (int k = 0; k < REDUCTION_LANES; k++) {
+         lanes[k] += a[(i + k) * strideA] * b[i + k];
+      }
+   }
+   for (int i = blocked; i < n; i++) {
+      lanes[i % REDUCTION_LANES] += a[i * strideA] * b[i];
+   }
+   return combineLanes(lanes);
+}
+
+// Sum of exp(values[i] - shift) over [0..n), the softmax denominator
+double reduceExpSum(const double *values, int n, double shift) {
+   if (!reproducibleReductions) {
+      double sum = 0.0;
+      #pragma omp simd reduction(+:sum)
+      for (int i = 0; i < n; i++) {
+         sum += exp(values[i] - shift);
+      }
+      return sum;
+   }
+
+   double lanes[REDUCTION_LANES] = {0};
+   for (int i = 0; i < n; i++) {
+      lanes[i % REDUCTION_LANES] += exp(values[i] - shift);
+   }
+   return combineLanes(lanes);
+}
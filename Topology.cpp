@@ -0,0 +1,486 @@
+/*
+   Class to represent the placement of the ranks on the nodes of the machine
+
+   Ranks that share a node exchange data through MPI shared memory windows
+   instead of messages. Collectives are hierarchical: the ranks of a node stage
+   their contribution in shared memory, one leader per node takes part in the
+   collective between nodes and the result is read back from shared memory.
+   When all ranks share one node there is no leader step, every rank reads the
+   staged values directly.
+
+   Ranks on a node synchronize through sequence flags in the shared windows
+   rather than barriers: a rank publishes the number of the last operation it
+   has staged, and only waits for the flags it needs. Buffers alternate between
+   two phases so an operation can be staged while the previous one is read.
+
+   With hierarchical set to false every operation falls back to the flat
+   MPI_COMM_WORLD version, which is used as the baseline by the comm benchmark.
+   In reproducible mode sums are formed in world rank order, see allreduce.
+
+   Messages are counted as the point to point sends issued by the rank plus
+   size - 1 for every collective over a communicator of that size. Shared memory
+   reads and writes are not counted, neither are the flags the ranks poll to
+   synchronize on the node.
+*/
+
+using namespace std;
+
+class Topology {
+private:
+   bool hierarchical;
+
+   // All ranks, used by the collectives
+   MPI_Comm nodeComm;
+   MPI_Comm leaderComm;
+   int nodeRank;
+   int nodeSize;
+   int numNodes;
+   vector<int> nodeSizes;         // size of every node, in leader order
+   vector<int> leaderOrderRanks;  // world ranks in the order the leaders gather them
+   MPI_Win collectiveWin;
+   volatile long long *collectiveFlags;  // leader owned, staging flag per node rank then the result flag
+   double *staging;               // leader owned, 2 phases of nodeSize * capacity
+   double *result;                // leader owned, 2 phases of worldSize * capacity
+   int collectiveCapacity;
+   long long collectiveSequence;  // number of collectives so far
+
+   // Worker ranks only, used by the ghost neuron exchange
+   MPI_Comm workerNodeComm;
+   vector<int> workerNodeRankOf;  // node rank of every world rank on this node, -1 otherwise
+   MPI_Win ringWin;
+   vector<double*> ringBases;     // start of every worker's flag and slots on this node
+   int ringCapacity;
+   long long ringSequence;        // number of ghost neuron exchanges so far
+
+   void allocateCollectiveWindow(int capacity);
+   void allocateRingWindow(int capacity);
+   double *ringSlot(int workerNodeRank, int phase, int which);
+   volatile long long *ringFlag(int workerNodeRank);
+   void waitForFlag(MPI_Win win, volatile long long *flag, long long sequence);
+   int stageCollective(double *sendBuffer, int count);
+public:
+   Topology(const bool &_hierarchical, const int &ranksPerNode);
+   ~Topology();
+   bool isHierarchical();
+   int getNumNodes();
+   void allgather(double *sendBuffer, int count, double *recvBuffer);
+   void allreduce(double *sendBuffer, int count, double *recvBuffer);
+   void ringExchange(double *firstOutputs, double *lastOutputs, int count, double *ghostTops, double *ghostBottoms, MPI_Comm comm);
+};
+
+/*
+   Construct the topology. Collective over MPI_COMM_WORLD.
+
+   Input: _hierarchical
+      Use node aware communication. Otherwise all operations are flat.
+   Input: ranksPerNode
+      If greater than 0 the ranks are additionally split into groups of
+      ranksPerNode consecutive ranks, which emulates smaller nodes when all
+      ranks run on a single machine.
+
+   Return: Topology object
+*/
+Topology::Topology(const bool &_hierarchical, const int &ranksPerNode) {
+   hierarchical = _hierarchical;
+   nodeComm = MPI_COMM_NULL;
+   leaderComm = MPI_COMM_NULL;
+   workerNodeComm = MPI_COMM_NULL;
+   collectiveWin = MPI_WIN_NULL;
+   ringWin = MPI_WIN_NULL;
+   collectiveFlags = NULL;
+   staging = NULL;
+   result = NULL;
+   collectiveCapacity = 0;
+   collectiveSequence = 0;
+   ringCapacity = 0;
+   ringSequence = 0;
+   nodeRank = 0;
+   nodeSize = 1;
+   numNodes = worldSize;
+
+   if (!hierarchical) {
+      return;
+   }
+
+   int color = ranksPerNode > 0 ? myRank / ranksPerNode : 0;
+
+   // Ranks on the same node
+   MPI_Comm sharedComm;
+   MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myRank, MPI_INFO_NULL, &sharedComm);
+   MPI_Comm_split(sharedComm, color, myRank, &nodeComm);
+   MPI_Comm_free(&sharedComm);
+   MPI_Comm_rank(nodeComm, &nodeRank);
+   MPI_Comm_size(nodeComm, &nodeSize);
+
+   // One leader per node
+   MPI_Comm_split(MPI_COMM_WORLD, nodeRank == 0 ? 0 : MPI_UNDEFINED, myRank, &leaderComm);
+
+   // The leaders learn which world ranks live on every node
+   vector<int> members(nodeSize);
+   MPI_Gather(&myRank, 1, MPI_INT, &members[0], 1, MPI_INT, 0, nodeComm);
+   if (nodeRank == 0) {
+      MPI_Comm_size(leaderComm, &numNodes);
+      nodeSizes.resize(numNodes);
+      MPI_Allgather(&nodeSize, 1, MPI_INT, &nodeSizes[0], 1, MPI_INT, leaderComm);
+      vector<int> displs(numNodes, 0);
+      for (int i = 1; i < numNodes; i++) {
+         displs[i] = displs[i - 1] + nodeSizes[i - 1];
+      }
+      leaderOrderRanks.resize(worldSize);
+      MPI_Allgatherv(&members[0], nodeSize, MPI_INT, &leaderOrderRanks[0], &nodeSizes[0], &displs[0], MPI_INT, leaderComm);
+   }
+   MPI_Bcast(&numNodes, 1, MPI_INT, 0, nodeComm);
+
+   // Worker ranks on the same node, for the ghost neuron exchange
+   MPI_Comm workerComm;
+   MPI_Comm_split(MPI_COMM_WORLD, myRank > 0 ? 0 : MPI_UNDEFINED, myRank, &workerComm);
+   if (workerComm != MPI_COMM_NULL) {
+      MPI_Comm_split_type(workerComm, MPI_COMM_TYPE_SHARED, myRank, MPI_INFO_NULL, &sharedComm);
+      MPI_Comm_split(sharedComm, color, myRank, &workerNodeComm);
+      MPI_Comm_free(&sharedComm);
+      MPI_Comm_free(&workerComm);
+
+      int workerNodeSize;
+      MPI_Comm_size(workerNodeComm, &workerNodeSize);
+      vector<int> workerMembers(workerNodeSize);
+      MPI_Allgather(&myRank, 1, MPI_INT, &workerMembers[0], 1, MPI_INT, workerNodeComm);
+      workerNodeRankOf.assign(worldSize, -1);
+      for (int i = 0; i < workerNodeSize; i++) {
+         workerNodeRankOf[workerMembers[i]] = i;
+      }
+   }
+
+   allocateCollectiveWindow(1);
+   if (workerNodeComm != MPI_COMM_NULL) {
+      allocateRingWindow(1);
+   }
+}
+
+Topology::~Topology() {
+   if (collectiveWin != MPI_WIN_NULL) {
+      MPI_Win_unlock_all(collectiveWin);
+      MPI_Win_free(&collectiveWin);
+   }
+   if (ringWin != MPI_WIN_NULL) {
+      MPI_Win_unlock_all(ringWin);
+      MPI_Win_free(&ringWin);
+   }
+   if (workerNodeComm != MPI_COMM_NULL) {
+      MPI_Comm_free(&workerNodeComm);
+   }
+   if (leaderComm != MPI_COMM_NULL) {
+      MPI_Comm_free(&leaderComm);
+   }
+   if (nodeComm != MPI_COMM_NULL) {
+      MPI_Comm_free(&nodeComm);
+   }
+}
+
+bool Topology::isHierarchical() {
+   return hierarchical;
+}
+
+int Topology::getNumNodes() {
+   return numNodes;
+}
+
+// (Re)allocate the node's collective flags, staging and result buffers. Collective over nodeComm.
+void Topology::allocateCollectiveWindow(int capacity) {
+   if (collectiveWin != MPI_WIN_NULL) {
+      // Ranks may still be copying the last result out of the old window
+      MPI_Barrier(nodeComm);
+      MPI_Win_unlock_all(collectiveWin);
+      MPI_Win_free(&collectiveWin);
+   }
+
+   MPI_Aint bytes = (nodeRank == 0) ? (MPI_Aint)(nodeSize + 1 + 2 * (nodeSize + worldSize) * capacity) * sizeof(double) : 0;
+   double *base;
+   MPI_Win_allocate_shared(bytes, sizeof(double), MPI_INFO_NULL, nodeComm, &base, &collectiveWin);
+
+   MPI_Aint leaderBytes;
+   int dispUnit;
+   MPI_Win_shared_query(collectiveWin, 0, &leaderBytes, &dispUnit, &base);
+   collectiveFlags = (volatile long long*)base;
+   staging = base + nodeSize + 1;
+   result = staging + 2 * nodeSize * capacity;
+   collectiveCapacity = capacity;
+   collectiveSequence = 0;
+   MPI_Win_lock_all(MPI_MODE_NOCHECK, collectiveWin);
+
+   collectiveFlags[nodeRank] = 0;
+   if (nodeRank == 0) {
+      collectiveFlags[nodeSize] = 0;
+   }
+   MPI_Win_sync(collectiveWin);
+   MPI_Barrier(nodeComm);
+   MPI_Win_sync(collectiveWin);
+}
+
+// (Re)allocate the ghost neuron slots. Per worker a sequence flag followed by
+// two phases of first and last outputs. Collective over workerNodeComm.
+void Topology::allocateRingWindow(int capacity) {
+   if (ringWin != MPI_WIN_NULL) {
+      MPI_Win_unlock_all(ringWin);
+      MPI_Win_free(&ringWin);
+   }
+
+   double *base;
+   MPI_Win_allocate_shared((MPI_Aint)(4 * capacity + 1) * sizeof(double), sizeof(double), MPI_INFO_NULL, workerNodeComm, &base, &ringWin);
+
+   int workerNodeSize;
+   MPI_Comm_size(workerNodeComm, &workerNodeSize);
+   ringBases.resize(workerNodeSize);
+   for (int i = 0; i < workerNodeSize; i++) {
+      MPI_Aint bytes;
+      int dispUnit;
+      MPI_Win_shared_query(ringWin, i, &bytes, &dispUnit, &ringBases[i]);
+   }
+   ringCapacity = capacity;
+   ringSequence = 0;
+   MPI_Win_lock_all(MPI_MODE_NOCHECK, ringWin);
+
+   *ringFlag(workerNodeRankOf[myRank]) = 0;
+   MPI_Win_sync(ringWin);
+   MPI_Barrier(workerNodeComm);
+   MPI_Win_sync(ringWin);
+}
+
+// which is 0 for the first neuron outputs and 1 for the last neuron outputs
+double *Topology::ringSlot(int workerNodeRank, int phase, int which) {
+   return ringBases[workerNodeRank] + 1 + (2 * phase + which) * ringCapacity;
+}
+
+// Number of the last exchange whose outputs the worker has published
+volatile long long *Topology::ringFlag(int workerNodeRank) {
+   return (volatile long long*)ringBases[workerNodeRank];
+}
+
+// Wait until a rank on this node has set a flag in win to at least sequence
+void Topology::waitForFlag(MPI_Win win, volatile long long *flag, long long sequence) {
+   MPI_Win_sync(win);
+   while (*flag < sequence) {
+      sched_yield();
+      MPI_Win_sync(win);
+   }
+   MPI_Win_sync(win);
+}
+
+/*
+   Start a hierarchical collective: stage this rank's values in the node's
+   shared memory and publish them. Every phase spans the whole capacity, so
+   consecutive collectives of different counts never overlap. A rank stages a
+   phase again two collectives later, by then every rank of the node has
+   staged the collective in between (or the leader has published its result,
+   which it only does after reading all of them), so nobody reads this phase
+   anymore.
+
+   Return: the phase of this collective
+*/
+int Topology::stageCollective(double *sendBuffer, int count) {
+   if (count > collectiveCapacity) {
+      allocateCollectiveWindow(count);
+   }
+   collectiveSequence++;
+   int phase = collectiveSequence % 2;
+   memcpy(staging + phase * nodeSize * collectiveCapacity + nodeRank * count, sendBuffer, count * sizeof(double));
+   MPI_Win_sync(collectiveWin);
+   collectiveFlags[nodeRank] = collectiveSequence;
+   MPI_Win_sync(collectiveWin);
+   return phase;
+}
+
+/*
+   Gather count values from every rank into recvBuffer, ordered by rank.
+   Collective over MPI_COMM_WORLD, every rank must pass the same count.
+*/
+void Topology::allgather(double *sendBuffer, int count, double *recvBuffer) {
+   double startTimeComm = MPI_Wtime();
+   commBytes += count * sizeof(double);
+
+   if (!hierarchical) {
+      MPI_Allgather(sendBuffer, count, MPI_DOUBLE, recvBuffer, count, MPI_DOUBLE, MPI_COMM_WORLD);
+      commMessages += worldSize - 1;
+      commWaitTime += MPI_Wtime() - startTimeComm;
+      return;
+   }
+
+   int phase = stageCollective(sendBuffer, count);
+   double *phaseStaging = staging + phase * nodeSize * collectiveCapacity;
+   double *phaseResult = result + phase * worldSize * collectiveCapacity;
+
+   // A single node is ordered by world rank, every rank reads the staged values
+   if (numNodes == 1) {
+      for (int r = 0; r < nodeSize; r++) {
+         waitForFlag(collectiveWin, &collectiveFlags[r], collectiveSequence);
+      }
+      memcpy(recvBuffer, phaseStaging, worldSize * count * sizeof(double));
+      commWaitTime += MPI_Wtime() - startTimeComm;
+      return;
+   }
+
+   // The leaders exchange whole nodes and place the values in rank order
+   if (nodeRank == 0) {
+      for (int r = 1; r < nodeSize; r++) {
+         waitForFlag(collectiveWin, &collectiveFlags[r], collectiveSequence);
+      }
+      vector<int> counts(numNodes);
+      vector<int> displs(numNodes, 0);
+      for (int i = 0; i < numNodes; i++) {
+         counts[i] = nodeSizes[i] * count;
+         if (i > 0) {
+            displs[i] = displs[i - 1] + counts[i - 1];
+         }
+      }
+      vector<double> gathered(worldSize * count);
+      MPI_Allgatherv(phaseStaging, nodeSize * count, MPI_DOUBLE, &gathered[0], &counts[0], &displs[0], MPI_DOUBLE, leaderComm);
+      commMessages += numNodes - 1;
+      for (int i = 0; i < worldSize; i++) {
+         memcpy(phaseResult + leaderOrderRanks[i] * count, &gathered[i * count], count * sizeof(double));
+      }
+      MPI_Win_sync(collectiveWin);
+      collectiveFlags[nodeSize] = collectiveSequence;
+      MPI_Win_sync(collectiveWin);
+   } else {
+      waitForFlag(collectiveWin, &collectiveFlags[nodeSize], collectiveSequence);
+   }
+
+   memcpy(recvBuffer, phaseResult, worldSize * count * sizeof(double));
+   commWaitTime += MPI_Wtime() - startTimeComm;
+}
+
+/*
+   Element wise sum of count values over all ranks.
+   Collective over MPI_COMM_WORLD, every rank must pass the same count.
+
+   In reproducible mode (reproducibleReductions) the values are gathered and
+   summed in world rank order, so the result depends neither on the reduction
+   algorithm picked by MPI nor on the placement of the ranks on the nodes.
+*/
+void Topology::allreduce(double *sendBuffer, int count, double *recvBuffer) {
+   if (reproducibleReductions) {
+      vector<double> gathered(worldSize * count);
+      allgather(sendBuffer, count, &gathered[0]);
+      for (int i = 0; i < count; i++) {
+         recvBuffer[i] = 0.0;
+         for (int r = 0; r < worldSize; r++) {
+            recvBuffer[i] += gathered[r * count + i];
+         }
+      }
+      return;
+   }
+
+   double startTimeComm = MPI_Wtime();
+   commBytes += count * sizeof(double);
+
+   if (!hierarchical) {
+      MPI_Allreduce(sendBuffer, recvBuffer, count, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+      commMessages += worldSize - 1;
+      commWaitTime += MPI_Wtime() - startTimeComm;
+      return;
+   }
+
+   int phase = stageCollective(sendBuffer, count);
+   double *phaseStaging = staging + phase * nodeSize * collectiveCapacity;
+   double *phaseResult = result + phase * worldSize * collectiveCapacity;
+
+   // Ranks are summed in node rank order so every run adds the values the
+   // same way. On a single node every rank forms the sum itself, otherwise
+   // the leader sums its node and reduces with the other leaders.
+   if (numNodes == 1 || nodeRank == 0) {
+      for (int r = 0; r < nodeSize; r++) {
+         waitForFlag(collectiveWin, &collectiveFlags[r], collectiveSequence);
+      }
+      vector<double> nodeSum(count, 0.0);
+      for (int r = 0; r < nodeSize; r++) {
+         for (int i = 0; i < count; i++) {
+            nodeSum[i] += phaseStaging[r * count + i];
+         }
+      }
+      if (numNodes == 1) {
+         memcpy(recvBuffer, &nodeSum[0], count * sizeof(double));
+         commWaitTime += MPI_Wtime() - startTimeComm;
+         return;
+      }
+      MPI_Allreduce(&nodeSum[0], phaseResult, count, MPI_DOUBLE, MPI_SUM, leaderComm);
+      commMessages += numNodes - 1;
+      MPI_Win_sync(collectiveWin);
+      collectiveFlags[nodeSize] = collectiveSequence;
+      MPI_Win_sync(collectiveWin);
+   } else {
+      waitForFlag(collectiveWin, &collectiveFlags[nodeSize], collectiveSequence);
+   }
+
+   memcpy(recvBuffer, phaseResult, count * sizeof(double));
+   commWaitTime += MPI_Wtime() - startTimeComm;
+}
+
+/*
+   Ghost neuron exchange between the worker ranks, which form a ring. Each rank
+   receives the last outputs of the previous rank into ghostTops and the first
+   outputs of the next rank into ghostBottoms. Neighbours on the same node read
+   each other's shared memory slot, only neighbours on other nodes exchange
+   messages (on comm). A rank only waits for its own neighbours, never for the
+   whole node.
+
+   Every worker rank must call this with the same count.
+*/
+void Topology::ringExchange(double *firstOutputs, double *lastOutputs, int count, double *ghostTops, double *ghostBottoms, MPI_Comm comm) {
+   double startTimeComm = MPI_Wtime();
+   int prevRank = (myRank == 1) ? (worldSize - 1) : (myRank - 1);
+   int nextRank = (myRank == worldSize - 1) ? 1 : (myRank + 1);
+   bool prevOnNode = hierarchical && workerNodeRankOf[prevRank] >= 0;
+   bool nextOnNode = hierarchical && workerNodeRankOf[nextRank] >= 0;
+
+   MPI_Request requests[4];
+   int numRequests = 0;
+
+   // R_r (lastNeuronOutput) -> R_r+1 (ghostTop)
+   if (!nextOnNode) {
+      MPI_Isend(lastOutputs, count, MPI_DOUBLE, nextRank, 0, comm, &requests[numRequests++]);
+      commBytes += count * sizeof(double);
+      commMessages++;
+   }
+   if (!prevOnNode) {
+      MPI_Irecv(ghostTops, count, MPI_DOUBLE, prevRank, 0, comm, &requests[numRequests++]);
+   }
+
+   // R_r (firstNeuronOutput) -> R_r-1 (ghostBottom)
+   if (!prevOnNode) {
+      MPI_Isend(firstOutputs, count, MPI_DOUBLE, prevRank, 1, comm, &requests[numRequests++]);
+      commBytes += count * sizeof(double);
+      commMessages++;
+   }
+   if (!nextOnNode) {
+      MPI_Irecv(ghostBottoms, count, MPI_DOUBLE, nextRank, 1, comm, &requests[numRequests++]);
+   }
+
+   if (hierarchical) {
+      if (count > ringCapacity) {
+         allocateRingWindow(count);
+      }
+
+      // Slots alternate between two phases. A rank writes a phase again two
+      // exchanges later, by then it has seen both neighbours publish the
+      // exchange in between, so they have finished reading this one.
+      ringSequence++;
+      int phase = ringSequence % 2;
+      int me = workerNodeRankOf[myRank];
+      memcpy(ringSlot(me, phase, 0), firstOutputs, count * sizeof(double));
+      memcpy(ringSlot(me, phase, 1), lastOutputs, count * sizeof(double));
+      MPI_Win_sync(ringWin);
+      *ringFlag(me) = ringSequence;
+      MPI_Win_sync(ringWin);
+
+      if (prevOnNode) {
+         waitForFlag(ringWin, ringFlag(workerNodeRankOf[prevRank]), ringSequence);
+         memcpy(ghostTops, ringSlot(workerNodeRankOf[prevRank], phase, 1), count * sizeof(double));
+      }
+      if (nextOnNode) {
+         waitForFlag(ringWin, ringFlag(workerNodeRankOf[nextRank]), ringSequence);
+         memcpy(ghostBottoms, ringSlot(workerNodeRankOf[nextRank], phase, 0), count * sizeof(double));
+      }
+   }
+
+   MPI_Waitall(numRequests, requests, MPI_STATUSES_IGNORE);
+   commWaitTime += MPI_Wtime() - startTimeComm;
+}
@@ -1,25 +1,56 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <mpi.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <math.h>
 #include <stdlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //  Global Variables
 int worldSize;
 int myRank;
 double rankTime = 0.0;
 
+// Bytes and messages sent and time spent in communication by this rank,
+// reported by MetricsLogger
+long long commBytes = 0;
+long long commMessages = 0;
+double commWaitTime = 0.0;
+
+// Fixed order reductions so that training is bitwise reproducible across
+// thread counts, see Reduction.cpp. Otherwise sums may be reordered.
+bool reproducibleReductions = false;
+
+// Node aware communication layer, see Topology.cpp
+class Topology;
+Topology *topology = NULL;
+
 double *globalData = NULL;
 double *localData = NULL;
 int outputsPerRank;
 
+#include "Reduction.cpp"
 #include "Neuron.cpp"
+#include "Optimizer.cpp"
+#include "Topology.cpp"
 #include "Layer.cpp"
 #include "Network.cpp"
+#include "Metrics.cpp"
 
 using namespace std;
 
@@ -28,11 +59,387 @@ int gcd(int a, int b) {
    return b == 0 ? a : gcd(b, a % b);
 }
 
+// Settings for a training run
+struct TrainingConfig {
+   string mode;               // sync or hogwild
+   int iterations;
+   int samplesPerIteration;
+   int numThreads;            // threads per rank for hogwild and evaluation
+   int syncFrequency;         // samples between rank synchronizations in hogwild
+   int evalInterval;          // iterations between evaluations, 0 disables
+   int evalBatchSize;
+   int topK;
+   string optimizer;          // sgd, momentum, nesterov or adam
+   double learningRate;
+   bool rounds;               // hogwild in bulk synchronous rounds, see Network::trainHogwild
+};
+
+// Name of the training algorithm a config runs, for the output and the metrics
+string modeName(const TrainingConfig &config) {
+   if (config.mode == "hogwild" && config.rounds) {
+      return "hogwild-rounds";
+   }
+   return config.mode;
+}
+
+/*
+   Train the network for the specified number of iterations and report the time
+   and loss of every iteration. Per iteration metrics are streamed through
+   metrics when it is enabled.
+
+   Every evalInterval iterations an evaluation pass scores the validation set
+   against a copy of the weights at that point. The pass is advanced by one batch
+   after every iteration, so training is never held up for more than a batch and
+   the gather of each batch overlaps the next iteration. A pass that is due while
+   the previous one is still running starts when it ends. At the end of training
+   the running pass is finished and the final weights are scored. Evaluation time
+   is left out of the throughput.
+
+   Input: config.mode
+      sync performs a synchronous forward/backward pass per sample.
+      hogwild trains with numThreads lock free threads per rank and synchronizes
+      the ranks every syncFrequency samples. With config.rounds it trains in
+      bulk synchronous rounds instead, reported as hogwild-rounds.
+
+   Return: samples per second (on rank 1)
+*/
+double train(Network &net, const TrainingConfig &config, MetricsLogger &metrics, int size) {
+   const string &mode = config.mode;
+   int iterations = config.iterations;
+   int samplesPerIteration = config.samplesPerIteration;
+   int numThreads = config.numThreads;
+   int syncFrequency = config.syncFrequency;
+
+   double startTimeT = 0;
+   double endTimeT = 0;
+   double totalTimeT = 0;
+
+   // Evaluation pass state, see Network::beginEvaluation
+   bool evalDue = false;
+   int evalIteration = 0;
+   double evalTime = 0;
+
+   // Used to determine performance
+   if (myRank == 1) {
+      startTimeT = MPI_Wtime();
+   }
+
+   // Train the network for the specified number of iterations
+   for (int i = 0; i < iterations; i++) {
+      double startTime = 0;
+      double endTime = 0;
+      double totalTime = 0;
+      double loss = 0;
+
+      if (myRank == 1) {
+         startTime = MPI_Wtime();
+      }
+      metrics.beginIteration();
+
+      if (mode == "hogwild") {
+         metrics.startPhase(PHASE_HOGWILD);
+         loss = net.trainHogwild(samplesPerIteration, numThreads, syncFrequency, config.rounds);
+         metrics.endPhase(PHASE_HOGWILD);
+      } else {
+         for (int s = 0; s < samplesPerIteration; s++) {
+            metrics.startPhase(PHASE_FORWARD);
+            net.forwardPropagation();
+            metrics.endPhase(PHASE_FORWARD);
+
+            metrics.startPhase(PHASE_LOSS);
+            loss += net.computeLoss(size);
+            metrics.endPhase(PHASE_LOSS);
+
+            metrics.startPhase(PHASE_BACKWARD);
+            net.backwardPropagation();
+            metrics.endPhase(PHASE_BACKWARD);
+         }
+         loss = loss / samplesPerIteration;
+      }
+
+      if (myRank == 1) {
+         endTime = MPI_Wtime();
+         totalTime = endTime - startTime;
+         printf("Iter: %d Time: %f Loss: %f\n", i, totalTime, loss);
+      }
+
+      bool lastIteration = (i == iterations - 1);
+      if (config.evalInterval > 0) {
+         double evalStart = MPI_Wtime();
+         metrics.startPhase(PHASE_EVAL);
+         if ((i + 1) % config.evalInterval == 0 || lastIteration) {
+            evalDue = true;
+         }
+
+         // One batch per iteration, everything that is left after the last one
+         do {
+            if (evalDue && !net.isEvaluating()) {
+               net.beginEvaluation(config.evalBatchSize, config.topK);
+               evalDue = false;
+               evalIteration = i;
+               evalTime = 0;
+            }
+            if (net.isEvaluating()) {
+               double batchStart = MPI_Wtime();
+               bool finished = net.advanceEvaluation(numThreads);
+               evalTime += MPI_Wtime() - batchStart;
+               if (finished && myRank == 1) {
+                  EvaluationMetrics evalMetrics = net.getEvaluationMetrics();
+                  printf("Eval: %d Samples: %d Top1: %f Top%d: %f CrossEntropy: %f NonFinite: %d Time: %f\n", evalIteration, evalMetrics.numSamples,
+                         evalMetrics.top1Accuracy, config.topK, evalMetrics.topKAccuracy, evalMetrics.crossEntropy, evalMetrics.numNonFinite, evalTime);
+               }
+            }
+         } while (lastIteration && (evalDue || net.isEvaluating()));
+
+         metrics.endPhase(PHASE_EVAL);
+         // Keep evaluation time out of the training throughput
+         startTimeT += MPI_Wtime() - evalStart;
+      }
+
+      metrics.endIteration(i, modeName(config), samplesPerIteration, loss);
+   }
+   metrics.finish();
+
+   // Compute the total time for the number of iterations
+   if (myRank == 1) {
+      endTimeT = MPI_Wtime();
+      totalTimeT = endTimeT - startTimeT;
+      printf("Total Time: %f\n", totalTimeT);
+      return (iterations * samplesPerIteration) / totalTimeT;
+   }
+   return 0;
+}
+
+// Construct a NN with 1 input layer, 3 hidden layers, and 1 output layer and
+// load the training data. The activations of the widest hidden layer are not
+// checkpointed, hogwild training recomputes them during back propagation.
+void buildNetwork(Network &net, Optimizer *optimizer, int numInputs, int numHidden1, int numHidden2, int numHidden3, int numOutputs, int size) {
+   net.setOptimizer(optimizer);
+   net.addLayer("input", numInputs);
+   net.addLayer("hidden", numHidden1/(worldSize - 1), false);
+   net.addLayer("hidden", numHidden2/(worldSize - 1));
+   net.addLayer("hidden", numHidden3/(worldSize - 1));
+   net.addLayer("output", numOutputs/(worldSize - 1));
+   net.initializeNetwork(size);
+
+   net.loadTestingInputData("genTestInput.txt");
+   net.loadTestingOutputData("genTestLabels.txt", numOutputs);
+}
+
+/*
+   Reproducibility check. Trains a fresh network on one thread and on numThreads
+   threads in three configurations and compares the weights of the two runs bit
+   for bit:
+
+      hogwild-rounds with reproducible reductions, what reproducible mode runs
+      hogwild-rounds with fast reductions
+      lock free hogwild with fast reductions, what fast mode runs
+
+   The check passes if every weight of every run is finite and the first
+   configuration gives identical weights on any number of threads. The rounds
+   runs are also compared with each other on numThreads threads, which shows
+   what the fixed order reductions change on the same algorithm. Whether the
+   lock free runs differ depends on how the OS interleaves the threads, so that
+   comparison is only reported. The check refuses to run on one thread or
+   without OpenMP, where both runs would trivially be identical.
+
+   Input: config
+      numThreads, syncFrequency, iterations and samplesPerIteration are used
+
+   Return: true if the check passed
+*/
+bool runReproducibilityCheck(const TrainingConfig &config, int numInputs, int numHidden1, int numHidden2, int numHidden3, int numOutputs, int size) {
+   bool multithreaded = config.numThreads > 1;
+#ifndef _OPENMP
+   multithreaded = false;
+#endif
+   if (!multithreaded) {
+      if (myRank == 0) {
+         cout << "Error: reprocheck needs an OpenMP build and more than one thread, otherwise both runs are single threaded and always identical." << "\n";
+      }
+      return false;
+   }
+
+   const int numChecks = 3;
+   const bool checkRounds[numChecks] = {true, true, false};
+   const bool checkReproducible[numChecks] = {true, false, false};
+   double mismatches[numChecks + 1];
+   double maxDifference[numChecks + 1];
+   double nonFinite[numChecks];
+   double samplesPerSecond[numChecks] = {0, 0, 0};
+   double numWeights = 0;
+   int numSamples = config.iterations * config.samplesPerIteration;
+   vector<double> roundsWeights[2];
+
+   for (int c = 0; c < numChecks; c++) {
+      reproducibleReductions = checkReproducible[c];
+      vector<double> weights[2];
+      double localNonFinite = 0;
+      for (int run = 0; run < 2; run++) {
+         int numThreads = run == 0 ? 1 : config.numThreads;
+         Optimizer optimizer = Optimizer(config.optimizer, config.learningRate);
+         Network net;
+         buildNetwork(net, &optimizer, numInputs, numHidden1, numHidden2, numHidden3, numOutputs, size);
+
+         MPI_Barrier(MPI_COMM_WORLD);
+         double startTime = MPI_Wtime();
+         for (int i = 0; i < config.iterations; i++) {
+            net.trainHogwild(config.samplesPerIteration, numThreads, config.syncFrequency, checkRounds[c]);
+         }
+         if (run == 1) {
+            samplesPerSecond[c] = numSamples / (MPI_Wtime() - startTime);
+         }
+         weights[run] = net.getWeights();
+         for (int i = 0; i < weights[run].size(); i++) {
+            if (!isfinite(weights[run][i])) {
+               localNonFinite++;
+            }
+         }
+      }
+      if (checkRounds[c]) {
+         roundsWeights[c] = weights[1];
+      }
+
+      double localMismatches = 0;
+      double localMaxDifference = 0;
+      for (int i = 0; i < weights[0].size(); i++) {
+         if (memcmp(&weights[0][i], &weights[1][i], sizeof(double)) != 0) {
+            localMismatches++;
+            localMaxDifference = max(localMaxDifference, fabs(weights[0][i] - weights[1][i]));
+         }
+      }
+      double localWeights = weights[0].size();
+      MPI_Reduce(&localMismatches, &mismatches[c], 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+      MPI_Reduce(&localMaxDifference, &maxDifference[c], 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+      MPI_Reduce(&localNonFinite, &nonFinite[c], 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+      MPI_Reduce(&localWeights, &numWeights, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+   }
+   reproducibleReductions = false;
+
+   // Same algorithm and thread count, reproducible against fast reductions
+   double localMismatches = 0;
+   double localMaxDifference = 0;
+   for (int i = 0; i < roundsWeights[0].size(); i++) {
+      if (memcmp(&roundsWeights[0][i], &roundsWeights[1][i], sizeof(double)) != 0) {
+         localMismatches++;
+         localMaxDifference = max(localMaxDifference, fabs(roundsWeights[0][i] - roundsWeights[1][i]));
+      }
+   }
+   MPI_Reduce(&localMismatches, &mismatches[numChecks], 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+   MPI_Reduce(&localMaxDifference, &maxDifference[numChecks], 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+   // Throughput is measured on rank 1, which holds part of the network
+   if (myRank == 1) {
+      MPI_Send(samplesPerSecond, numChecks, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD);
+   } else if (myRank == 0) {
+      MPI_Recv(samplesPerSecond, numChecks, MPI_DOUBLE, 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+   }
+
+   int passed = 1;
+   if (myRank == 0) {
+      const char *checkNames[numChecks] = {"hogwild-rounds, reproducible reductions:", "hogwild-rounds, fast reductions:", "hogwild, fast reductions:"};
+      printf("Reproducibility check: 1 vs %d threads, %d samples, sync every %d\n", config.numThreads, numSamples, config.syncFrequency);
+      for (int c = 0; c < numChecks; c++) {
+         printf("  %-41s %.0f of %.0f weights differ (max difference %g) non-finite %.0f samples/sec %f\n",
+                checkNames[c], mismatches[c], numWeights, maxDifference[c], nonFinite[c], samplesPerSecond[c]);
+      }
+      printf("  hogwild-rounds on %d threads, reproducible vs fast reductions: %.0f of %.0f weights differ (max difference %g)\n",
+             config.numThreads, mismatches[numChecks], numWeights, maxDifference[numChecks]);
+      if (mismatches[2] > 0) {
+         printf("  Note: the lock free runs differ, they depend on how the threads interleave\n");
+      } else {
+         printf("  Note: the lock free runs are identical, the threads did not race on this run\n");
+      }
+      if (nonFinite[0] + nonFinite[1] + nonFinite[2] > 0) {
+         passed = 0;
+         printf("  FAIL: training produced non-finite weights\n");
+      }
+      if (mismatches[0] > 0) {
+         passed = 0;
+         printf("  FAIL: reproducible runs differ\n");
+      }
+      if (passed) {
+         printf("  PASS: reproducible runs are bitwise identical\n");
+      }
+   }
+   MPI_Bcast(&passed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+   return passed != 0;
+}
+
+/*
+   Communication benchmark. Runs the exchanges of a training iteration (one ghost
+   neuron exchange per hidden layer and the gather of the outputs) with the flat
+   and with the hierarchical communication layer and reports the messages sent
+   and the time taken by each.
+
+   Input: ranksPerNode
+      Emulated node size, 0 uses the real nodes
+   Input: repetitions
+      Number of iterations to run
+   Input: numHiddenLayers
+      Number of ghost neuron exchanges per iteration
+*/
+void runCommBenchmark(int ranksPerNode, int repetitions, int numHiddenLayers) {
+   double messages[2];
+   double times[2];
+   int numNodes = 0;
+
+   for (int h = 0; h < 2; h++) {
+      Topology *benchTopology = new Topology(h == 1, ranksPerNode);
+      if (h == 1) {
+         numNodes = benchTopology->getNumNodes();
+      }
+      vector<double> outputs(outputsPerRank, (double)myRank);
+      vector<double> gathered(outputsPerRank * worldSize);
+      double first = myRank;
+      double last = myRank;
+      double ghostTop = 0;
+      double ghostBottom = 0;
+
+      long long startMessages = commMessages;
+      MPI_Barrier(MPI_COMM_WORLD);
+      double startTime = MPI_Wtime();
+      for (int i = 0; i < repetitions; i++) {
+         if (myRank > 0 && worldSize > 2) {
+            for (int l = 0; l < numHiddenLayers; l++) {
+               benchTopology->ringExchange(&first, &last, 1, &ghostTop, &ghostBottom, MPI_COMM_WORLD);
+            }
+         }
+         benchTopology->allgather(&outputs[0], outputsPerRank, &gathered[0]);
+      }
+      double localTime = MPI_Wtime() - startTime;
+      double localMessages = (double)(commMessages - startMessages);
+
+      MPI_Reduce(&localMessages, &messages[h], 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+      MPI_Reduce(&localTime, &times[h], 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+      delete benchTopology;
+   }
+
+   if (myRank == 0) {
+      printf("Ranks: %d Nodes: %d Iterations: %d\n", worldSize, numNodes, repetitions);
+      printf("  Flat:         messages %.0f (%.1f per iteration) time %f\n", messages[0], messages[0] / repetitions, times[0]);
+      printf("  Hierarchical: messages %.0f (%.1f per iteration) time %f\n", messages[1], messages[1] / repetitions, times[1]);
+      if (messages[1] > 0) {
+         printf("  Message reduction: %.2fx\n", messages[0] / messages[1]);
+      } else {
+         printf("  Message reduction: all exchanges through shared memory\n");
+      }
+   }
+}
+
 int main(int argc, char *argv[]) {
 
-   MPI_Init(&argc, &argv);
+   // Only the main thread makes MPI calls, hogwild threads do not communicate
+   int provided;
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
    MPI_Comm_size( MPI_COMM_WORLD, &worldSize);
    MPI_Comm_rank( MPI_COMM_WORLD, &myRank);
+   if (provided < MPI_THREAD_FUNNELED) {
+      if (myRank == 0) {
+         cout << "Error: the MPI library does not support MPI_THREAD_FUNNELED, which hogwild training requires." << "\n";
+      }
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
 
    int numInputs = 2048;
    int numHidden1 = 32768;
@@ -40,9 +447,66 @@ int main(int argc, char *argv[]) {
    int numHidden3 = 4096;
    int numOutputs = 2048;
 
-   double startTimeT = 0;
-   double endTimeT = 0;
-   double totalTimeT = 0;
+   // Usage: run [sync|hogwild|compare] [numThreads] [syncFrequency] [samplesPerIteration] [metrics] [fast|reproducible]
+   //            [validationInput validationLabels] [optimizer] [learningRate]
+   // compare trains a fresh network with each mode on the same samples and
+   // reports the throughput and loss of both. metrics is a file name or
+   // unix:<socket path> that receives one JSON line per iteration, an empty
+   // string disables it. reproducible uses fixed order reductions and trains
+   // hogwild in bulk synchronous rounds (reported as hogwild-rounds) so the same
+   // configuration gives bitwise identical weights for any number of threads.
+   // The held out set is scored every evalInterval iterations, without one
+   // only the training loss is reported (pass "" "" to skip it and still choose
+   // the optimizer). optimizer is sgd, momentum, nesterov or adam.
+   //
+   // Usage: run reprocheck [numThreads] [syncFrequency] [samplesPerIteration]
+   // checks that reproducible hogwild training gives the same weights on one
+   // and on numThreads (at least 2) threads, see runReproducibilityCheck.
+   // samplesPerIteration defaults to syncFrequency so every round is full.
+   //
+   // Usage: run commbench [ranksPerNode] [repetitions]
+   // compares the flat and hierarchical communication layer, see runCommBenchmark.
+   string mode = argc > 1 ? argv[1] : "sync";
+   int numThreads = argc > 2 ? atoi(argv[2]) : 4;
+   int syncFrequency = argc > 3 ? atoi(argv[3]) : 8;
+   int samplesPerIteration = argc > 4 ? atoi(argv[4]) : (mode == "reprocheck" ? syncFrequency : 1);
+   string metricsDestination = argc > 5 ? argv[5] : "";
+   string reductions = argc > 6 ? argv[6] : "fast";
+   string validationInputPath = argc > 8 ? argv[7] : "";
+   string validationLabelsPath = argc > 8 ? argv[8] : "";
+   string optimizerType = argc > 9 ? argv[9] : "momentum";
+   double learningRate = argc > 10 ? atof(argv[10]) : 0.001;
+   int iterations = 20;
+
+   // Score the held out set every evalInterval iterations
+   int evalInterval = validationInputPath.empty() ? 0 : 10;
+   int evalBatchSize = 8;
+   int topK = 5;
+
+   if (mode != "sync" && mode != "hogwild" && mode != "compare" && mode != "commbench" && mode != "reprocheck") {
+      if (myRank == 0) {
+         cout << "Error: " << mode << " is not a valid mode. Valid modes are sync, hogwild, compare, commbench, and reprocheck." << "\n";
+      }
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+   if (reductions != "fast" && reductions != "reproducible") {
+      if (myRank == 0) {
+         cout << "Error: " << reductions << " is not a valid reduction mode. Valid reduction modes are fast and reproducible." << "\n";
+      }
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+   reproducibleReductions = (reductions == "reproducible");
+   if (learningRate <= 0) {
+      if (myRank == 0) {
+         cout << "Error: the learning rate must be greater than 0." << "\n";
+      }
+      MPI_Abort(MPI_COMM_WORLD, 1);
+   }
+#ifndef _OPENMP
+   if (mode != "commbench" && numThreads > 1 && myRank == 0) {
+      cout << "Warning: built without OpenMP, hogwild training and evaluation run on one thread per rank." << "\n";
+   }
+#endif
 
    // Check that the number of ranks does not exceed the maximum allowed
    if(myRank == 0){
@@ -57,58 +521,76 @@ int main(int argc, char *argv[]) {
    outputsPerRank = numOutputs / (worldSize - 1);
    localData = (double*)malloc(outputsPerRank * sizeof(double));
 
-   // Construct a NN with 1 input layer, 3 hidden layers, and 1 output layer
-   Network net = Network();
-   net.addLayer("input", numInputs);
-   net.addLayer("hidden", numHidden1/(worldSize - 1));
-   net.addLayer("hidden", numHidden2/(worldSize - 1));
-   net.addLayer("hidden", numHidden3/(worldSize - 1));
-   net.addLayer("output", numOutputs/(worldSize - 1));
-   net.initializeNetwork(size);
+   if (mode == "commbench") {
+      int ranksPerNode = argc > 2 ? atoi(argv[2]) : 0;
+      int repetitions = argc > 3 ? atoi(argv[3]) : 100;
+      runCommBenchmark(ranksPerNode, repetitions, 3);
+      MPI_Finalize();
+      return 0;
+   }
 
-   // Load the testing data
-   net.loadTestingInputData("genTestInput.txt");
-   net.loadTestingOutputData("genTestLabels.txt", numOutputs);
+   // Split the ranks by node for the intra node shared memory exchanges
+   topology = new Topology(true, 0);
 
-   // Print the network info
-   if (myRank == 0) {
-      net.printNetworkInfo();
+   TrainingConfig config = TrainingConfig();
+   config.iterations = iterations;
+   config.samplesPerIteration = samplesPerIteration;
+   config.numThreads = numThreads;
+   config.syncFrequency = syncFrequency;
+   config.evalInterval = evalInterval;
+   config.evalBatchSize = evalBatchSize;
+   config.topK = topK;
+   config.optimizer = optimizerType;
+   config.learningRate = learningRate;
+   config.rounds = reproducibleReductions;
+
+   if (mode == "reprocheck") {
+      bool passed = runReproducibilityCheck(config, numInputs, numHidden1, numHidden2, numHidden3, numOutputs, size);
+      delete topology;
+      MPI_Finalize();
+      return passed ? 0 : 1;
    }
 
-   // Used to determine performance
-   if (myRank == 1) {
-      startTimeT = MPI_Wtime();
+   vector<string> modes;
+   if (mode == "compare") {
+      modes.push_back("sync");
+      modes.push_back("hogwild");
+   } else {
+      modes.push_back(mode);
    }
 
-   int iterations = 20;
-   // Train the network for the specified number of iterations
-   for (int i = 0; i < iterations; i++) {
-      double startTime = 0;
-      double endTime = 0;
-      double totalTime = 0;
+   MetricsLogger *metrics = new MetricsLogger(metricsDestination);
 
-      if (myRank == 1) {
-         startTime = MPI_Wtime();
-      }
+   vector<double> samplesPerSecond;
+   for (int m = 0; m < modes.size(); m++) {
+      Optimizer optimizer = Optimizer(config.optimizer, config.learningRate);
 
-      net.forwardPropagation();
-      net.computeLoss(size);
-      net.backwardPropagation();
+      Network net;
+      buildNetwork(net, &optimizer, numInputs, numHidden1, numHidden2, numHidden3, numOutputs, size);
+      if (evalInterval > 0) {
+         net.loadValidationData(validationInputPath, validationLabelsPath, numOutputs);
+      }
 
-      if (myRank == 1) {
-         endTime = MPI_Wtime();
-         totalTime = endTime - startTime;
-         printf("Iter: %d Time: %f\n", i, totalTime);
+      // Print the network info
+      config.mode = modes[m];
+      if (myRank == 0) {
+         net.printNetworkInfo();
+         cout << "Mode: " << modeName(config) << " Reductions: " << reductions << " Optimizer: " << config.optimizer << " " << config.learningRate << endl;
       }
+
+      samplesPerSecond.push_back(train(net, config, *metrics, size));
+      net.printMemoryUsage();
    }
 
-   // Compute the total time for the number of iterations
-   if (myRank == 1) {
-      endTimeT = MPI_Wtime();
-      totalTimeT = endTimeT - startTimeT;
-      printf("Total Time: %f\n", totalTimeT);
+   if (mode == "compare" && myRank == 1) {
+      printf("Samples/sec sync: %f %s (%d threads, sync every %d): %f speedup: %.2fx\n",
+             samplesPerSecond[0], modeName(config).c_str(), numThreads, syncFrequency, samplesPerSecond[1], samplesPerSecond[1] / samplesPerSecond[0]);
    }
 
+   // Flushes the last iteration and frees the metrics communicator
+   delete metrics;
+   delete topology;
+
    MPI_Finalize();
    return 0;
 